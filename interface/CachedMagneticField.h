@@ -0,0 +1,53 @@
+#ifndef SimG4Core_CachedMagneticField_H
+#define SimG4Core_CachedMagneticField_H
+
+// Regular 3D grid of the field values of another MagneticField,
+// interpolated trilinearly. Points outside the grid box are passed
+// to the full field. Positions are in cm, as for MagneticField.
+
+#include "MagneticField/Engine/interface/MagneticField.h"
+
+#include <string>
+#include <vector>
+
+class CachedMagneticField : public MagneticField
+{
+public:
+    CachedMagneticField(const MagneticField * field,
+                        double rMax, double zMax, double step);
+    virtual ~CachedMagneticField();
+
+    virtual GlobalVector inTesla(const GlobalPoint & gp) const;
+    virtual GlobalVector inTeslaUnchecked(const GlobalPoint & gp) const;
+    virtual bool isDefined(const GlobalPoint & gp) const { return m_field->isDefined(gp); }
+
+    /// fills the grid from the full field
+    void build();
+    /// reads a grid written by write(); false if missing or for another grid
+    bool read(const std::string & fileName);
+    bool write(const std::string & fileName) const;
+    /// largest difference (Tesla) to the full field at the centres
+    /// of one grid cell out of stride
+    double maxDeviation(unsigned int stride) const;
+    unsigned int size() const { return m_nx*m_ny*m_nz; }
+
+private:
+    /// trilinear interpolation in the grid cell of gp, which must be inside
+    GlobalVector interpolate(const GlobalPoint & gp) const;
+    bool inside(const GlobalPoint & gp) const {
+      return (gp.x() >= m_xMin && gp.x() <= m_xMax &&
+              gp.y() >= m_yMin && gp.y() <= m_yMax &&
+              gp.z() >= m_zMin && gp.z() <= m_zMax);
+    }
+
+    const MagneticField * m_field;
+    unsigned int m_nx, m_ny, m_nz;
+    float m_xMin, m_yMin, m_zMin;
+    float m_xMax, m_yMax, m_zMax;
+    float m_step, m_invStep;
+    // four floats (Bx,By,Bz,0) per node, x running fastest, so that
+    // every corner of a cell is one aligned 16-byte load
+    std::vector<float> m_grid;
+};
+
+#endif
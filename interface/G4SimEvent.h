@@ -32,18 +32,41 @@ public:
     const int nparam() const { return nparam_; }
     void param(const std::vector<float>& p) { param_ = p; }
     const std::vector<float> & param() const { return param_; }
-    void add(G4SimTrack * t) { g4tracks.push_back(t); }
-    void add(G4SimVertex * v) { g4vertices.push_back(v); }
-    const G4SimTrack & g4track(int i) const { return *g4tracks[i-1]; }
-    const G4SimVertex & g4vertex(int i) const { return *g4vertices[i-1]; }
+    /// load converts the tracks and vertices with TBB tasks
+    void loadInParallel(bool b) { loadInParallel_ = b; }
+    /// tracks or vertices converted by one task
+    static const unsigned int grainSize = 1024;
+    /// tracks and vertices are stored by value; tracks added in increasing
+    /// ID order need no sorting in load
+    void add(const G4SimTrack & t) {
+      if (!g4tracks.empty() && t.id() < g4tracks.back().id()) tracksOrdered_ = false;
+      g4tracks.push_back(t);
+    }
+    void add(const G4SimVertex & v) { g4vertices.push_back(v); }
+    /// appends the tracks, taking over the vector when there are none yet;
+    /// t is left empty
+    void addTracks(std::vector<G4SimTrack> & t) {
+      if (g4tracks.empty()) {
+        g4tracks.swap(t);
+        for (unsigned int i = 1; i < g4tracks.size(); i++)
+          if (g4tracks[i].id() < g4tracks[i-1].id()) { tracksOrdered_ = false; break; }
+      } else {
+        for (unsigned int i = 0; i < t.size(); i++) add(t[i]);
+      }
+      std::vector<G4SimTrack>().swap(t);
+    }
+    const G4SimTrack & g4track(int i) const { return g4tracks[i-1]; }
+    const G4SimVertex & g4vertex(int i) const { return g4vertices[i-1]; }
 protected:
     const HepMC::GenEvent * hepMCEvent;  
     float weight_;
     math::XYZTLorentzVectorD collisionPoint_;
     int nparam_;
     std::vector<float> param_;
-    std::vector<G4SimTrack *> g4tracks;
-    std::vector<G4SimVertex *> g4vertices;
+    std::vector<G4SimTrack> g4tracks;
+    std::vector<G4SimVertex> g4vertices;
+    bool tracksOrdered_;
+    bool loadInParallel_;
 };
 
 #endif
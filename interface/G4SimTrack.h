@@ -34,6 +34,7 @@ public:
   const math::XYZVectorD & momentum() const { return ip_; }
   const double energy() const { return ie_; }
   int const ivert() const { return ivert_; }
+  void setIvert(int iv) { ivert_ = iv; }
   int const igenpart() const { return igenpart_; }
   // parent momentum at interaction
   const math::XYZVectorD & parentMomentum() const { return parentMomentum_; } 
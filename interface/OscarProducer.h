@@ -13,6 +13,9 @@
 
 #include "SimG4Core/Application/interface/CustomUIsession.h"
 
+#include <string>
+#include <vector>
+
 namespace CLHEP {
     class HepRandomEngine;
 }
@@ -28,6 +31,8 @@ public:
     virtual void beginJob();
     virtual void endJob();
     virtual void produce(edm::Event & e, const edm::EventSetup& c) override;
+    virtual void postForkReacquireResources(unsigned int iChildIndex, 
+                                            unsigned int iNumberOfChildren) override;
 protected:
     RunManager*   m_runManager;
     Producers     m_producers;
@@ -35,6 +40,9 @@ protected:
 
 private:
     CLHEP::HepRandomEngine*  m_engine;
+    bool m_fillHitsInParallel;
+    // those of names which are produced (HitCollections)
+    std::vector<std::string> producedNames(const std::vector<std::string> & names) const;
 };
 
 #endif
@@ -16,6 +16,9 @@
 
 #include "SimG4Core/Notification/interface/SimActivityRegistry.h"
 
+#include "SimG4Core/Application/interface/SimTrackManager.h"
+#include "SimG4Core/Application/interface/StartupProfiler.h"
+
 #include <memory>
 #include "boost/shared_ptr.hpp"
 
@@ -26,6 +29,7 @@
 
 namespace CLHEP {
   class HepJamesRandom;
+  class HepRandomEngine;
 }
 
 namespace sim {
@@ -33,6 +37,8 @@ namespace sim {
 }
 
 class PrimaryTransformer;
+class MagneticField;
+class CachedMagneticField;
 class Generator;
 class PhysicsList;
 
@@ -58,6 +64,8 @@ public:
     //static RunManager * init(edm::ParameterSet const & p); 
     virtual ~RunManager();
     void initG4(const edm::EventSetup & es);
+    /// called in a child process forked by the framework, before initG4
+    void setChildIndex(unsigned int index);
     void initializeUserActions();
     void initializeRun();
     void terminateRun();
@@ -74,12 +82,36 @@ public:
     std::vector<boost::shared_ptr<SimProducer> > producers() const {
        return m_producers;
     }
+    bool storeRndmSeeds() const { return m_StoreRndmSeeds; }
+    /// the PSimHit and PCaloHit collections the SDs can fill
+    static const std::vector<std::string> & simHitCollections();
+    static const std::vector<std::string> & caloHitCollections();
+    /// HitCollections: true if this collection is produced
+    bool producesHitCollection(const std::string & name) const;
+    /// random engine state at the start of the current event (StoreRndmSeeds)
+    const std::vector<unsigned long>& randomState() const { return m_randomState; }
 protected:
     G4Event * generateEvent( edm::Event& inpevt );
 
     void resetGenParticleId( edm::Event& inpevt ); 
+
+    void restoreRandomState( edm::Event& inpevt, CLHEP::HepRandomEngine * engine );
 private:
 
+    // key of the physics tables cache: digest of the Physics PSet,
+    // the production cuts and materials of all regions and the
+    // Geant4 version
+    std::string physicsTablesKey() const;
+
+    // interpolation grid in front of the full magnetic field, stored
+    // under a digest of fieldLabel and the MagneticField PSet;
+    // false if it does not reach the requested accuracy
+    bool createFieldCache(const MagneticField * field, const std::string & fieldLabel);
+
+    // HitCollections: false if none of these collections is produced
+    bool producesHits(const std::vector<std::string> & names) const;
+    void deactivate(G4VSensitiveDetector * sd);
+
     // static RunManager * me;
     // explicit RunManager(edm::ParameterSet const & p);
     
@@ -107,6 +139,11 @@ private:
     std::string m_PhysicsTablesDir;
     bool m_StorePhysicsTables;
     bool m_RestorePhysicsTables;
+    bool m_UsePhysicsTablesCache;
+    bool m_StoreRndmSeeds;
+    bool m_RestoreRndmSeeds;
+    edm::InputTag m_RndmSeedsTag;
+    std::vector<unsigned long> m_randomState;
     int m_EvtMgrVerbosity;
     bool m_Override;
     bool m_check;
@@ -127,6 +164,8 @@ private:
     AttachSD * m_attach;
     std::vector<SensitiveTkDetector*> m_sensTkDets;
     std::vector<SensitiveCaloDetector*> m_sensCaloDets;
+    // the only hit collections produced (sorted), all if empty
+    std::vector<std::string> m_hitCollections;
 
     SimActivityRegistry m_registry;
     std::vector<boost::shared_ptr<SimWatcher> > m_watchers;
@@ -134,13 +173,19 @@ private:
     
     std::auto_ptr<SimTrackManager> m_trackManager;
     sim::FieldBuilder             *m_fieldBuilder;
+    std::auto_ptr<CachedMagneticField> m_fieldCache;
     
     edm::ESWatcher<IdealGeometryRecord> idealGeomRcdWatcher_;
     edm::ESWatcher<IdealMagneticFieldRecord> idealMagRcdWatcher_;
 
     edm::InputTag m_theLHCTlinkTag;
+    SimTrackManager::LHCTransportLinkMap m_theLHCTlinkMap;
 
     std::string m_WriteFile;
+
+    StartupProfiler m_startupProfiler;
+    std::string m_StartupReportFile;
+    bool m_ConvertTracksInParallel;
 };
 
 #endif
@@ -20,14 +20,17 @@
 //
 
 // system include files
+#include <cstdio>
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 // user include files
 #include "SimG4Core/Application/interface/G4SimEvent.h"
+#include "SimG4Core/Application/interface/G4SimTrack.h"
+#include "SimG4Core/Application/interface/TkCaloStateInfoMap.h"
 #include "SimG4Core/Notification/interface/TrackWithHistory.h"
 #include "SimG4Core/Notification/interface/TrackContainer.h" 
-
 #include "SimDataFormats/Forward/interface/LHCTransportLinkContainer.h"
 
 // forward declarations
@@ -45,8 +48,71 @@ public:
   /// this map contains association between vertex number and position
   typedef std::pair<int,math::XYZVectorD> MapVertexPosition;
   typedef std::vector<std::pair<int,math::XYZVectorD> > MapVertexPositionVector;
-  typedef std::map<int,MapVertexPositionVector> MotherParticleToVertexMap;
-  typedef MotherParticleToVertexMap VertexMap;
+  /// vertices of one parent quantised in cubic cells of twice the
+  /// merging distance: coincident vertices are in neighbouring cells
+  struct VertexCell {
+    int parent;
+    long long ix, iy, iz;
+    bool operator==(const VertexCell & c) const {
+      return (parent == c.parent && ix == c.ix && iy == c.iy && iz == c.iz);
+    }
+  };
+  struct VertexCellHash {
+    std::size_t operator()(const VertexCell & c) const {
+      std::size_t h = std::size_t(c.parent);
+      h = h*0x9E3779B97F4A7C15ULL + std::size_t(c.ix);
+      h = h*0x9E3779B97F4A7C15ULL + std::size_t(c.iy);
+      h = h*0x9E3779B97F4A7C15ULL + std::size_t(c.iz);
+      return h ^ (h >> 29);
+    }
+  };
+  typedef std::unordered_map<VertexCell,MapVertexPositionVector,VertexCellHash> VertexMap;
+  /// GenParticle id after LHC transport -> id before
+  typedef std::unordered_map<int,int> LHCTransportLinkMap;
+  /// what cleaning and ordering need of a track, in a compact array
+  struct TrackRecord {
+    unsigned int trackID;
+    int parentID;
+    unsigned int position;   // in the track container before ordering
+    bool saved;
+  };
+  /// a cleaned track of a finished primary reduced to what its SimTrack
+  /// and SimVertex are made of: 80 bytes of plain data
+  struct PackedTrack {
+    unsigned int trackID;
+    int parentID;
+    int particleID;
+    int genParticleID;
+    double momentum[3];
+    double energy;
+    double vertexPosition[3];
+    double globalTime;
+  };
+
+  /// one int per G4 track ID (IDs are small and dense within an event),
+  /// -1 for the IDs never set. clear() only touches the IDs set since
+  /// the previous clear
+  class TrackIDTable {
+  public:
+    int operator[](unsigned int id) const { return (id < m_value.size()) ? m_value[id] : -1; }
+    void set(unsigned int id, int value) {
+      if (id >= m_value.size()) m_value.resize(id+1,-1);
+      if (m_value[id] < 0) m_ids.push_back(id);
+      m_value[id] = value;
+    }
+    /// IDs in the order they were first set
+    const std::vector<unsigned int> & ids() const { return m_ids; }
+    bool empty() const { return m_ids.empty(); }
+    void clear() {
+      for (unsigned int i=0; i<m_ids.size(); i++) m_value[m_ids[i]] = -1;
+      m_ids.clear();
+    }
+    void release() { std::vector<int>().swap(m_value); std::vector<unsigned int>().swap(m_ids); }
+    void swap(TrackIDTable & t) { m_value.swap(t.m_value); m_ids.swap(t.m_ids); }
+  private:
+    std::vector<int> m_value;
+    std::vector<unsigned int> m_ids;
+  };
   
   SimTrackManager(bool iCollapsePrimaryVertices =false);
   virtual ~SimTrackManager();
@@ -65,70 +131,120 @@ public:
   void cleanTkCaloStateInfoMap();
   
   void addTrack(TrackWithHistory* iTrack, bool inHistory, bool withAncestor) {
-    std::pair<int, int> thePair(iTrack->trackID(),iTrack->parentID());
-    idsave.push_back(thePair);
-    if (inHistory) m_trksForThisEvent->push_back(iTrack);
-    if (withAncestor) { std::pair<int,int> thisPair(iTrack->trackID(),0); ancestorList.push_back(thisPair); }
+    if (iTrack->trackID() > m_maxTrackID) m_maxTrackID = iTrack->trackID();
+    idsave.set(iTrack->trackID(),iTrack->parentID());
+    if (inHistory) { m_trksForThisEvent->push_back(iTrack); m_inHistory.set(iTrack->trackID(),1); }
+    if (withAncestor) ancestorList.set(iTrack->trackID(),0);
   }
   
   void addTkCaloStateInfo(uint32_t t,const std::pair<math::XYZVectorD,math::XYZTLorentzVectorD>& p){
-    std::map<uint32_t,std::pair<math::XYZVectorD,math::XYZTLorentzVectorD> >::const_iterator it = 
-      mapTkCaloStateInfo.find(t);
-    
-    if (it ==  mapTkCaloStateInfo.end())
-      mapTkCaloStateInfo.insert(std::pair<uint32_t,std::pair<math::XYZVectorD,math::XYZTLorentzVectorD> >(t,p));
-    
+    mapTkCaloStateInfo.insert(t,p);
   }
   void setCollapsePrimaryVertices(bool iSet) {
     m_collapsePrimaryVertices=iSet;
   }
-  int giveMotherNeeded(int i) const { 
-    int theResult = 0;
-    for (unsigned int itr=0; itr<idsave.size(); itr++) { if ((idsave[itr]).first == i) { theResult = (idsave[itr]).second; break; } }
-    return theResult ; 
+  /// above this size (0: no limit) the tracks of the finished primaries
+  /// are packed and moved to a temporary file, read back by storeTracks
+  void setMaxHistoryMemory(unsigned int megabytes) {
+    m_maxHistoryMemory = std::size_t(megabytes)*1048576;
   }
-  bool trackExists(unsigned int i) const {
-    bool flag = false;
-    for (unsigned int itr=0; itr<(*m_trksForThisEvent).size(); ++itr) {
-      if ((*m_trksForThisEvent)[itr]->trackID() == i) {
-	flag = true; break;
-      }
-    }
-    return flag;
+  /// the per-event containers keep their capacity, unless this number
+  /// of events in a row (0: never) used less than a quarter of it
+  void setShrinkAfterEvents(unsigned int nEvents) { m_shrinkAfterEvents = nEvents; }
+  /// the saved tracks of a finished primary are packed at once and
+  /// leave the container, which then holds the current primary only
+  void setStreamPrimaries(bool iSet) { m_streamPrimaries = iSet; }
+  /// storeTracks converts the tracks with TBB tasks
+  void setConvertInParallel(bool iSet) { m_convertInParallel = iSet; }
+  int giveMotherNeeded(int i) const { 
+    int theResult = idsave[i];
+    return (theResult < 0) ? 0 : theResult; 
   }
+  bool trackExists(unsigned int i) const { return (m_inHistory[i] > 0); }
   void cleanTracksWithHistory();
-  void setLHCTransportLink( const edm::LHCTransportLinkContainer * thisLHCTlink ) { theLHCTlink = thisLHCTlink; }
+  void setLHCTransportLink( const LHCTransportLinkMap * thisLHCTlink ) { theLHCTlink = thisLHCTlink; }
+  /// if an id appears twice in links, the last link is the one applied
+  static void fillLHCTransportLinkMap( const edm::LHCTransportLinkContainer & links, LHCTransportLinkMap & linkMap );
 
 private:
   SimTrackManager(const SimTrackManager&); // stop default
   
   const SimTrackManager& operator=(const SimTrackManager&); // stop default
   
-  void saveTrackAndItsBranch(TrackWithHistory *);
-  int getOrCreateVertex(TrackWithHistory *,int,G4SimEvent * simEvent);
+  void saveTrackAndItsBranch(unsigned int iRecord);
+  void sortByTrackID(unsigned int first);
+  int getOrCreateVertex(const math::XYZVectorD & pos,double time,int iParentID,G4SimEvent * simEvent);
+  VertexCell vertexCell(int parent, const math::XYZVectorD & pos) const;
   void cleanVertexMap();
   void reallyStoreTracks(G4SimEvent * simEvent);
   void fillMotherList();
-  int idSavedTrack (int) const;
+  void packTracks();
+  /// the track at position in the history made of the spilled tracks,
+  /// m_packedTracks, then the container; tracks in the container are
+  /// packed into buffer
+  const PackedTrack & packedTrack(unsigned int position, PackedTrack & buffer) const;
+  void spillTracks();
+  void closeSpillFile();
+  void releaseMemory();
+  int idSavedTrack (int);
 
   // to restore the pre-LHCTransport GenParticle id link to a SimTrack
   void resetGenID();
 
   // ---------- member data --------------------------------
+  // points to m_trackContainer during an event, 0 otherwise
   TrackContainer * m_trksForThisEvent;
+  TrackContainer m_trackContainer;
   bool m_SaveSimTracks;
-  MotherParticleToVertexMap m_vertexMap;
+  VertexMap m_vertexMap;
   int m_nVertices;
   bool m_collapsePrimaryVertices;
-  std::map<uint32_t,std::pair<math::XYZVectorD,math::XYZTLorentzVectorD > > mapTkCaloStateInfo;
-  std::vector< std::pair<int, int> > idsave;
-
-  std::vector<std::pair<int, int> > ancestorList; 
+  TkCaloStateInfoMap mapTkCaloStateInfo;
+  // parent of each track of the current primary; after storeTracks,
+  // the first saved ancestor of the tracks of ancestorList
+  TrackIDTable idsave;
+  // first saved ancestor (0 until resolved) of the tracks kept for the SDs
+  TrackIDTable ancestorList; 
+  // 1 for the tracks currently in m_trksForThisEvent
+  TrackIDTable m_inHistory;
 
+  // number of tracks already cleaned, including the spilled and packed
+  // ones: the others are the first lastTrack-m_nSpilled-m_packedTracks.size()
+  // of m_trksForThisEvent
   unsigned int lastTrack;
   unsigned int lastHist;
 
-  const edm::LHCTransportLinkContainer * theLHCTlink;
+  // (track ID, parent ID) of the tracks already cleaned, in the order
+  // the history had before the spilling
+  std::vector<std::pair<unsigned int,int> > m_cleanedTracks;
+  std::size_t m_maxHistoryMemory;
+  std::FILE * m_spillFile;
+  unsigned int m_nSpilled;
+  // the spilled tracks mapped in memory by reallyStoreTracks, 0 otherwise
+  const PackedTrack * m_spilledTracks;
+
+  // largest track ID of this event, and since the containers were last
+  // given back
+  unsigned int m_maxTrackID;
+  unsigned int m_maxTrackIDKept;
+  unsigned int m_shrinkAfterEvents;
+  unsigned int m_nSmallEvents;
+
+  // the cleaned tracks of the finished primaries, in the order of the
+  // cleaning, packed when streamed or before being spilled
+  std::vector<PackedTrack> m_packedTracks;
+  bool m_streamPrimaries;
+  bool m_convertInParallel;
+  // position in the ordered output by track ID; valid in reallyStoreTracks
+  TrackIDTable m_trackIndex;
+
+  // scratch space of sortByTrackID; m_trackRecords then describes the
+  // sorted range, during cleaning the tracks of the current primary
+  std::vector<TrackRecord> m_trackRecords;
+  std::vector<unsigned int> m_runBounds;
+  TrackContainer m_sortedTracks;
+
+  const LHCTransportLinkMap * theLHCTlink;
 
 };
 
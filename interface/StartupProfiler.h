@@ -0,0 +1,43 @@
+#ifndef SimG4Core_StartupProfiler_H
+#define SimG4Core_StartupProfiler_H
+
+// Measures wall time, CPU time and resident memory growth of the
+// successive phases of RunManager::initG4. Phases are opened with
+// start() and closed with stop() (or by the next start()).
+
+#include <string>
+#include <vector>
+
+class StartupProfiler
+{
+public:
+    StartupProfiler();
+    ~StartupProfiler();
+    void start(const std::string & phase);
+    void stop();
+    /// MessageLogger summary, plus a JSON report if fileName is not empty
+    void report(const std::string & fileName) const;
+private:
+    struct Phase
+    {
+        std::string name;
+        double wallTime;   // s
+        double cpuTime;    // s
+        double rssDelta;   // MB
+    };
+    struct Sample
+    {
+        double wallTime;
+        double cpuTime;
+        double rss;
+    };
+    static Sample now();
+    void writeJSON(const std::string & fileName) const;
+
+    std::vector<Phase> m_phases;
+    std::string m_current;
+    Sample m_startOfPhase;
+    bool m_running;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SimG4Core_TkCaloStateInfoMap_H
+#define SimG4Core_TkCaloStateInfoMap_H
+
+// Tracker/calorimeter boundary state of the tracks, keyed by G4 track
+// ID, in an open-addressing table with linear probing. The table keeps
+// its capacity between events: clear() only advances a generation
+// number, the slots of older generations count as empty.
+
+#include "DataFormats/Math/interface/Vector3D.h"
+#include "DataFormats/Math/interface/LorentzVector.h"
+
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+class TkCaloStateInfoMap
+{
+public:
+    typedef std::pair<math::XYZVectorD,math::XYZTLorentzVectorD> TkCaloStateInfo;
+
+    TkCaloStateInfoMap();
+    ~TkCaloStateInfoMap();
+
+    /// the first state given for a track is kept
+    void insert(uint32_t id, const TkCaloStateInfo & info);
+    /// 0 if there is no state for this track
+    const TkCaloStateInfo * find(uint32_t id) const;
+    void clear();
+    /// clear() and give back the memory above the initial size
+    void release();
+    unsigned int size() const { return m_size; }
+    unsigned int capacity() const { return m_slots.size(); }
+
+private:
+    struct Slot
+    {
+        uint32_t        id;
+        unsigned int    generation;
+        TkCaloStateInfo info;
+    };
+
+    unsigned int slotOf(uint32_t id) const { return (id*2654435761U) >> m_shift; }
+    void grow();
+
+    std::vector<Slot> m_slots;     // power-of-two size
+    unsigned int m_shift;          // 32 - log2(size)
+    unsigned int m_size;
+    unsigned int m_generation;     // the slots of this generation are in use
+};
+
+#endif
@@ -24,6 +24,8 @@
 
 #include <iostream>
 
+#include "tbb/parallel_for.h"
+
 namespace {
     //
     // this machinery allows to set CLHEP static engine
@@ -51,51 +53,22 @@ OscarProducer::OscarProducer(edm::ParameterSet const & p)
 {   
     StaticRandomEngineSetUnset random;
     m_engine = random.getEngine();
+    m_fillHitsInParallel = p.getUntrackedParameter<bool>("FillHitsInParallel",false);
+
+    //m_runManager = RunManager::init(p);
+    m_runManager = new RunManager(p);
     
     produces<edm::SimTrackContainer>().setBranchAlias("SimTracks");
     produces<edm::SimVertexContainer>().setBranchAlias("SimVertices");
-    produces<edm::PSimHitContainer>("TrackerHitsPixelBarrelLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsPixelBarrelHighTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTIBLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTIBHighTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTIDLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTIDHighTof");
-    produces<edm::PSimHitContainer>("TrackerHitsPixelEndcapLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsPixelEndcapHighTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTOBLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTOBHighTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTECLowTof");
-    produces<edm::PSimHitContainer>("TrackerHitsTECHighTof");
-    
-    produces<edm::PSimHitContainer>("TotemHitsT1");
-    produces<edm::PSimHitContainer>("TotemHitsT2Gem");
-    produces<edm::PSimHitContainer>("TotemHitsRP");
-    produces<edm::PSimHitContainer>("FP420SI");
-    produces<edm::PSimHitContainer>("BSCHits");
-    produces<edm::PSimHitContainer>("PLTHits");
-
-    produces<edm::PCaloHitContainer>("EcalHitsEB");
-    produces<edm::PCaloHitContainer>("EcalHitsEE");
-    produces<edm::PCaloHitContainer>("EcalHitsES");
-    produces<edm::PCaloHitContainer>("HcalHits");
-    produces<edm::PCaloHitContainer>("CaloHitsTk");
-    produces<edm::PSimHitContainer>("MuonDTHits");
-    produces<edm::PSimHitContainer>("MuonCSCHits");
-    produces<edm::PSimHitContainer>("MuonRPCHits");
-    produces<edm::PSimHitContainer>("MuonGEMHits");
-    produces<edm::PCaloHitContainer>("CastorPL");
-    produces<edm::PCaloHitContainer>("CastorFI");
-    produces<edm::PCaloHitContainer>("CastorBU");
-    produces<edm::PCaloHitContainer>("CastorTU");
-    produces<edm::PCaloHitContainer>("EcalTBH4BeamHits");
-    produces<edm::PCaloHitContainer>("HcalTB06BeamHits");
-    produces<edm::PCaloHitContainer>("ZDCHITS"); 
-    produces<edm::PCaloHitContainer>("ChamberHits"); 
-    produces<edm::PCaloHitContainer>("FibreHits"); 
-    produces<edm::PCaloHitContainer>("WedgeHits"); 
-    
-    //m_runManager = RunManager::init(p);
-    m_runManager = new RunManager(p);
+    const std::vector<std::string> & simHits = RunManager::simHitCollections();
+    for (unsigned int i = 0; i < simHits.size(); i++)
+      if (m_runManager->producesHitCollection(simHits[i])) produces<edm::PSimHitContainer>(simHits[i]);
+    const std::vector<std::string> & caloHits = RunManager::caloHitCollections();
+    for (unsigned int i = 0; i < caloHits.size(); i++)
+      if (m_runManager->producesHitCollection(caloHits[i])) produces<edm::PCaloHitContainer>(caloHits[i]);
+
+    if (m_runManager->storeRndmSeeds())
+      produces<std::vector<unsigned long> >("G4RndmState");
 
     //register any products 
     m_producers= m_runManager->producers();
@@ -126,6 +99,16 @@ void OscarProducer::beginRun(const edm::Run & r, const edm::EventSetup & es)
 }
 
 
+void OscarProducer::postForkReacquireResources(unsigned int iChildIndex, 
+                                               unsigned int iNumberOfChildren)
+{
+  // the RandomNumberGeneratorService gives every child its own seeds
+  StaticRandomEngineSetUnset random;
+  m_engine = random.getEngine();
+
+  m_runManager->setChildIndex(iChildIndex);
+}
+
 void OscarProducer::beginJob()
 {
   StaticRandomEngineSetUnset random(m_engine);
@@ -153,24 +136,56 @@ void OscarProducer::produce(edm::Event & e, const edm::EventSetup & es)
     e.put(p1);
     e.put(p2);
 
-    for (std::vector<SensitiveTkDetector*>::iterator it = sTk.begin(); it != sTk.end(); it++)
+    if (m_runManager->storeRndmSeeds())
     {
-	std::vector<std::string> v = (*it)->getNames();
-	for (std::vector<std::string>::iterator in = v.begin(); in!= v.end(); in++)
+	std::auto_ptr<std::vector<unsigned long> > state(new std::vector<unsigned long>(m_runManager->randomState()));
+	e.put(state,"G4RndmState");
+    }
+
+    // the collections of every SD are filled first, possibly one SD per
+    // task (the names of one SD in turn, as they share its state), then
+    // put in the order of the SD lists
+    unsigned int nTk = sTk.size(), nCalo = sCalo.size();
+    std::vector<std::vector<std::string> > tkNames(nTk), caloNames(nCalo);
+    std::vector<std::vector<edm::PSimHitContainer> > tkHits(nTk);
+    std::vector<std::vector<edm::PCaloHitContainer> > caloHits(nCalo);
+    for (unsigned int i = 0; i < nTk; i++)
+    {
+	tkNames[i] = producedNames(sTk[i]->getNames());
+	tkHits[i].resize(tkNames[i].size());
+    }
+    for (unsigned int i = 0; i < nCalo; i++)
+    {
+	caloNames[i] = producedNames(sCalo[i]->getNames());
+	caloHits[i].resize(caloNames[i].size());
+    }
+    auto fillHits = [&](unsigned int i) {
+	if (i < nTk) {
+	    for (unsigned int n = 0; n < tkNames[i].size(); n++) sTk[i]->fillHits(tkHits[i][n],tkNames[i][n]);
+	} else {
+	    i -= nTk;
+	    for (unsigned int n = 0; n < caloNames[i].size(); n++) sCalo[i]->fillHits(caloHits[i][n],caloNames[i][n]);
+	}
+    };
+    if (m_fillHitsInParallel) tbb::parallel_for(0u,nTk+nCalo,fillHits);
+    else for (unsigned int i = 0; i < nTk+nCalo; i++) fillHits(i);
+
+    for (unsigned int i = 0; i < nTk; i++)
+    {
+	for (unsigned int n = 0; n < tkNames[i].size(); n++)
 	{
 	    std::auto_ptr<edm::PSimHitContainer> product(new edm::PSimHitContainer);
- 	    (*it)->fillHits(*product,*in);
-	    e.put(product,*in);
+	    product->swap(tkHits[i][n]);
+	    e.put(product,tkNames[i][n]);
 	}
     }
-    for (std::vector<SensitiveCaloDetector*>::iterator it = sCalo.begin(); it != sCalo.end(); it++)
+    for (unsigned int i = 0; i < nCalo; i++)
     {
-	std::vector<std::string>  v = (*it)->getNames();
-	for (std::vector<std::string>::iterator in = v.begin(); in!= v.end(); in++)
+	for (unsigned int n = 0; n < caloNames[i].size(); n++)
 	{
 	    std::auto_ptr<edm::PCaloHitContainer> product(new edm::PCaloHitContainer);
-	    (*it)->fillHits(*product,*in);
-	    e.put(product,*in);
+	    product->swap(caloHits[i][n]);
+	    e.put(product,caloNames[i][n]);
 	}
     }
 
@@ -191,6 +206,14 @@ void OscarProducer::produce(edm::Event & e, const edm::EventSetup & es)
 }
 
 
+std::vector<std::string> OscarProducer::producedNames(const std::vector<std::string> & names) const
+{
+    std::vector<std::string> v;
+    for (unsigned int i = 0; i < names.size(); i++)
+      if (m_runManager->producesHitCollection(names[i])) v.push_back(names[i]);
+    return v;
+}
+
 StaticRandomEngineSetUnset::StaticRandomEngineSetUnset() {
 
     using namespace edm;
@@ -40,17 +40,32 @@ g4SimHits = cms.EDProducer("OscarProducer",
     OverrideUserStackingAction = cms.bool(True),
     StoreRndmSeeds = cms.bool(False),
     RestoreRndmSeeds = cms.bool(False),
+    RndmSeedsTag = cms.untracked.InputTag("g4SimHits","G4RndmState"),
     PhysicsTablesDirectory = cms.string('PhysicsTables'),
     StorePhysicsTables = cms.bool(False),
     RestorePhysicsTables = cms.bool(False),
+    UsePhysicsTablesCache = cms.untracked.bool(False),
     CheckOverlap = cms.untracked.bool(False),
     G4Commands = cms.vstring(),
     FileNameGDML = cms.untracked.string(''),
+    StartupReportFile = cms.untracked.string(''),
+    FillHitsInParallel = cms.untracked.bool(False),
+    ConvertTracksInParallel = cms.untracked.bool(False),
+    # NOTE : a non-empty list switches off the SDs none of whose
+    #        collections is listed; they no longer mark the tracks
+    #        crossing them for storing, so SimTracks and SimVertices
+    #        change as well
+    HitCollections = cms.untracked.vstring(),
     Watchers = cms.VPSet(),
     theLHCTlinkTag = cms.InputTag("LHCTransport"),
     MagneticField = cms.PSet(
         UseLocalMagFieldManager = cms.bool(False),
         Verbosity = cms.untracked.bool(False),
+        UseFieldCache = cms.untracked.bool(False),
+        FieldCacheRMax = cms.untracked.double(130.0), ## in cm
+        FieldCacheZMax = cms.untracked.double(300.0), ## in cm
+        FieldCacheStep = cms.untracked.double(5.0), ## in cm
+        FieldCacheTolerance = cms.untracked.double(0.001), ## in Tesla
         ConfGlobalMFM = cms.PSet(
             Volume = cms.string('OCMS'),
             OCMS = cms.PSet(
@@ -150,7 +165,10 @@ g4SimHits = cms.EDProducer("OscarProducer",
     EventAction = cms.PSet(
         debug = cms.untracked.bool(False),
         StopFile = cms.string('StopRun'),
-        CollapsePrimaryVertices = cms.bool(False)
+        CollapsePrimaryVertices = cms.bool(False),
+        MaxTrackHistoryMemory = cms.untracked.uint32(0),
+        ShrinkTrackHistoryAfter = cms.untracked.uint32(10),
+        StreamFinishedPrimaries = cms.untracked.bool(False)
     ),
     StackingAction = cms.PSet(
         common_heavy_suppression,
@@ -0,0 +1,143 @@
+#include "SimG4Core/Application/interface/CachedMagneticField.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+namespace {
+  const char         cacheMagic[8] = {'S','I','M','G','4','F','L','D'};
+  const unsigned int cacheVersion  = 1;
+
+  struct CacheHeader {
+    char         magic[8];
+    unsigned int version;
+    unsigned int nx, ny, nz;
+    float        xMin, yMin, zMin, step;
+  };
+}
+
+CachedMagneticField::CachedMagneticField(const MagneticField * field,
+                                         double rMax, double zMax, double step)
+  : m_field(field)
+{
+  m_nx = m_ny = (unsigned int)(2.*rMax/step + 0.5) + 1;
+  m_nz        = (unsigned int)(2.*zMax/step + 0.5) + 1;
+  m_step      = step;
+  m_invStep   = 1./step;
+  m_xMin = m_yMin = -rMax;
+  m_zMin          = -zMax;
+  m_xMax = m_xMin + (m_nx-1)*m_step;
+  m_yMax = m_yMin + (m_ny-1)*m_step;
+  m_zMax = m_zMin + (m_nz-1)*m_step;
+}
+
+CachedMagneticField::~CachedMagneticField() {}
+
+GlobalVector CachedMagneticField::inTesla(const GlobalPoint & gp) const
+{
+  if (inside(gp)) return interpolate(gp);
+  return m_field->inTesla(gp);
+}
+
+GlobalVector CachedMagneticField::inTeslaUnchecked(const GlobalPoint & gp) const
+{
+  if (inside(gp)) return interpolate(gp);
+  return m_field->inTeslaUnchecked(gp);
+}
+
+GlobalVector CachedMagneticField::interpolate(const GlobalPoint & gp) const
+{
+  float fx = (gp.x()-m_xMin)*m_invStep;
+  float fy = (gp.y()-m_yMin)*m_invStep;
+  float fz = (gp.z()-m_zMin)*m_invStep;
+  int ix = std::min(std::max(int(fx),0),int(m_nx)-2);
+  int iy = std::min(std::max(int(fy),0),int(m_ny)-2);
+  int iz = std::min(std::max(int(fz),0),int(m_nz)-2);
+  float dx = fx-ix, dy = fy-iy, dz = fz-iz;
+
+  const unsigned int sx = 4, sy = 4*m_nx, sz = 4*m_nx*m_ny;
+  const float * c = &m_grid[(iz*m_ny + iy)*sy + ix*sx];
+
+  // the same interpolation on the four lanes of every node
+  float b[4];
+  for (unsigned int k=0; k<4; k++) {
+    float c00 = c[k]         + dx*(c[sx+k]         - c[k]);
+    float c10 = c[sy+k]      + dx*(c[sy+sx+k]      - c[sy+k]);
+    float c01 = c[sz+k]      + dx*(c[sz+sx+k]      - c[sz+k]);
+    float c11 = c[sz+sy+k]   + dx*(c[sz+sy+sx+k]   - c[sz+sy+k]);
+    float c0  = c00 + dy*(c10-c00);
+    float c1  = c01 + dy*(c11-c01);
+    b[k]      = c0  + dz*(c1-c0);
+  }
+  return GlobalVector(b[0],b[1],b[2]);
+}
+
+void CachedMagneticField::build()
+{
+  m_grid.assign(4*size(),0.f);
+  unsigned int n = 0;
+  for (unsigned int iz=0; iz<m_nz; iz++) {
+    for (unsigned int iy=0; iy<m_ny; iy++) {
+      for (unsigned int ix=0; ix<m_nx; ix++) {
+        GlobalPoint gp(m_xMin+ix*m_step, m_yMin+iy*m_step, m_zMin+iz*m_step);
+        GlobalVector b = m_field->inTesla(gp);
+        m_grid[n++] = b.x();
+        m_grid[n++] = b.y();
+        m_grid[n++] = b.z();
+        n++;
+      }
+    }
+  }
+}
+
+bool CachedMagneticField::read(const std::string & fileName)
+{
+  std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+  if (!in) return false;
+
+  CacheHeader h;
+  in.read((char*)(&h), sizeof(h));
+  if (!in || std::memcmp(h.magic,cacheMagic,sizeof(cacheMagic)) != 0 ||
+      h.version != cacheVersion || h.nx != m_nx || h.ny != m_ny || h.nz != m_nz ||
+      h.xMin != m_xMin || h.yMin != m_yMin || h.zMin != m_zMin || h.step != m_step)
+    return false;
+
+  m_grid.resize(4*size());
+  in.read((char*)(&m_grid[0]), m_grid.size()*sizeof(float));
+  if (!in) {
+    m_grid.clear();
+    return false;
+  }
+  return true;
+}
+
+bool CachedMagneticField::write(const std::string & fileName) const
+{
+  std::ofstream out(fileName.c_str(), std::ios::out | std::ios::binary);
+  if (!out) return false;
+
+  CacheHeader h;
+  std::memcpy(h.magic,cacheMagic,sizeof(cacheMagic));
+  h.version = cacheVersion;
+  h.nx = m_nx; h.ny = m_ny; h.nz = m_nz;
+  h.xMin = m_xMin; h.yMin = m_yMin; h.zMin = m_zMin; h.step = m_step;
+  out.write((const char*)(&h), sizeof(h));
+  out.write((const char*)(&m_grid[0]), m_grid.size()*sizeof(float));
+  return bool(out);
+}
+
+double CachedMagneticField::maxDeviation(unsigned int stride) const
+{
+  double dmax = 0;
+  unsigned int ncells = (m_nx-1)*(m_ny-1)*(m_nz-1);
+  for (unsigned int n=0; n<ncells; n+=stride) {
+    unsigned int ix = n%(m_nx-1);
+    unsigned int iy = (n/(m_nx-1))%(m_ny-1);
+    unsigned int iz = n/((m_nx-1)*(m_ny-1));
+    GlobalPoint gp(m_xMin+(ix+0.5)*m_step, m_yMin+(iy+0.5)*m_step, m_zMin+(iz+0.5)*m_step);
+    double d = (interpolate(gp) - m_field->inTesla(gp)).mag();
+    if (d > dmax) dmax = d;
+  }
+  return dmax;
+}
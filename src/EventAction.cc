@@ -19,6 +19,9 @@ EventAction::EventAction(const edm::ParameterSet & p,
       m_debug(p.getUntrackedParameter<bool>("debug",false))
 {
   m_trackManager->setCollapsePrimaryVertices(p.getParameter<bool>("CollapsePrimaryVertices"));
+  m_trackManager->setMaxHistoryMemory(p.getUntrackedParameter<unsigned int>("MaxTrackHistoryMemory",0));
+  m_trackManager->setShrinkAfterEvents(p.getUntrackedParameter<unsigned int>("ShrinkTrackHistoryAfter",10));
+  m_trackManager->setStreamPrimaries(p.getUntrackedParameter<bool>("StreamFinishedPrimaries",false));
 }
 
 EventAction::~EventAction() {}
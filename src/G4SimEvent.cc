@@ -3,6 +3,9 @@
 
 #include "G4SystemOfUnits.hh"
 
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
 class IdSort{
 public:
   bool operator()(const SimTrack& a, const SimTrack& b) {
@@ -14,49 +17,21 @@ public:
 G4SimEvent::G4SimEvent() : hepMCEvent(0),
                            weight_(0),
                            collisionPoint_(math::XYZTLorentzVectorD(0.,0.,0.,0.)),
-			   nparam_(0),param_(0) {}
-
-G4SimEvent::~G4SimEvent() 
-{
+			   nparam_(0),param_(0),tracksOrdered_(true),
+                           loadInParallel_(false) {}
 
-/*
-   while ( !g4tracks.empty() )
-   {
-      delete g4tracks.back() ;
-      g4tracks.pop_back() ;
-   }
-   while ( !g4vertices.empty() )
-   {
-      delete g4vertices.back() ;
-      g4vertices.pop_back() ;
-   }
-*/
-
-   // per suggestion by Chris Jones, it's faster 
-   // that delete back() and pop_back() 
-   //
-   unsigned int i = 0 ;
-   
-   for ( i=0; i<g4tracks.size(); i++ )
-   {
-      delete g4tracks[i] ;
-      g4tracks[i] = 0 ;
-   }
-   g4tracks.clear() ;
-   
-   for ( i=0; i<g4vertices.size(); i++ )
-   {
-      delete g4vertices[i] ;
-      g4vertices[i] = 0 ;
-   }
-   g4vertices.clear();
-}
+G4SimEvent::~G4SimEvent() {}
 
 void G4SimEvent::load(edm::SimTrackContainer & c) const
 {
-    for (unsigned int i=0; i<g4tracks.size(); i++)
+    // every track is converted into its own place, so the order is the
+    // one of the serial loop
+    unsigned int offset = c.size();
+    c.resize(offset+g4tracks.size());
+    auto convert = [&](const tbb::blocked_range<unsigned int> & range) {
+    for (unsigned int i=range.begin(); i!=range.end(); i++)
     {
-	G4SimTrack * trk    = g4tracks[i];
+	const G4SimTrack * trk = &g4tracks[i];
 	int ip              = trk->part();
 	math::XYZTLorentzVectorD p( trk->momentum().x()/GeV,
 	                            trk->momentum().y()/GeV,
@@ -76,20 +51,28 @@ void G4SimEvent::load(edm::SimTrackContainer & c) const
 	// pp = 4-momentum
 	// iv = corresponding G4SimVertex index
 	// ig = corresponding GenParticle index
-	SimTrack t = SimTrack(ip,p,iv,ig,tkpos,tkmom);
+	SimTrack & t = c[offset+i];
+	t = SimTrack(ip,p,iv,ig,tkpos,tkmom);
 	t.setTrackId(id);
 	t.setEventId(EncodedEventId(0));
-	c.push_back(t);
     }
-    std::stable_sort(c.begin(),c.end(),IdSort());
+    };
+    tbb::blocked_range<unsigned int> allTracks(0,g4tracks.size(),grainSize);
+    if (loadInParallel_) tbb::parallel_for(allTracks,convert);
+    else convert(allTracks);
+    // SimTrackManager adds the tracks in ID order already
+    if (offset > 0 || !tracksOrdered_) std::stable_sort(c.begin(),c.end(),IdSort());
     
 }
 
 void G4SimEvent::load(edm::SimVertexContainer & c) const
 {
-    for (unsigned int i=0; i<g4vertices.size(); i++)
+    unsigned int offset = c.size();
+    c.resize(offset+g4vertices.size());
+    auto convert = [&](const tbb::blocked_range<unsigned int> & range) {
+    for (unsigned int i=range.begin(); i!=range.end(); i++)
     {
-	G4SimVertex * vtx   = g4vertices[i];
+	const G4SimVertex * vtx = &g4vertices[i];
 	//
 	// starting 1_1_0_pre3, SimVertex stores in cm !!!
 	// 
@@ -101,9 +84,13 @@ void G4SimEvent::load(edm::SimVertexContainer & c) const
 	// vv = position
 	// t  = global time
 	// iv = index of the parent in the SimEvent SimTrack container (-1 if no parent)
-	SimVertex v = SimVertex(v3,t,iv,i);
+	SimVertex & v = c[offset+i];
+	v = SimVertex(v3,t,iv,i);
 	v.setEventId(EncodedEventId(0));
-	c.push_back(v);
     }
+    };
+    tbb::blocked_range<unsigned int> allVertices(0,g4vertices.size(),grainSize);
+    if (loadInParallel_) tbb::parallel_for(allVertices,convert);
+    else convert(allVertices);
 }
 
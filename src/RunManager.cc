@@ -7,6 +7,7 @@
 #include "SimG4Core/Application/interface/SteppingAction.h"
 #include "SimG4Core/Application/interface/G4SimEvent.h"
 #include "SimG4Core/Application/interface/ParametrisedEMPhysics.h"
+#include "SimG4Core/Application/interface/CachedMagneticField.h"
 
 #include "SimG4Core/Geometry/interface/DDDWorld.h"
 #include "SimG4Core/Geometry/interface/G4LogicalVolumeToDDLogicalPartMap.h"
@@ -28,11 +29,13 @@
 #include "FWCore/Framework/interface/EventSetup.h"
 #include "FWCore/Framework/interface/ESHandle.h"
 #include "FWCore/Framework/interface/ESTransientHandle.h"
+#include "FWCore/Framework/interface/ComponentDescription.h"
 #include "Geometry/Records/interface/IdealGeometryRecord.h"
 
 #include "DetectorDescription/Core/interface/DDCompactView.h"
 
 #include "FWCore/ServiceRegistry/interface/Service.h"
+#include "FWCore/Utilities/interface/Digest.h"
 
 #include "SimDataFormats/GeneratorProducts/interface/HepMCProduct.h"
 #include "SimDataFormats/Forward/interface/LHCTransportLinkContainer.h"
@@ -51,14 +54,25 @@
 #include "G4Run.hh"
 #include "G4Event.hh"
 #include "G4TransportationManager.hh"
+#include "G4Navigator.hh"
+#include "G4Material.hh"
 #include "G4ParticleTable.hh"
+#include "G4RegionStore.hh"
+#include "G4ProductionCuts.hh"
+#include "G4Version.hh"
 
 #include "G4GDMLParser.hh"
 
+#include "CLHEP/Random/Random.h"
+
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <memory>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
@@ -99,6 +113,26 @@ void createWatchers(const edm::ParameterSet& iP,
   }
 }
 
+namespace {
+  // the hit collections the SDs can fill
+  const char * const simHitNames[] = {
+    "TrackerHitsPixelBarrelLowTof", "TrackerHitsPixelBarrelHighTof",
+    "TrackerHitsTIBLowTof", "TrackerHitsTIBHighTof",
+    "TrackerHitsTIDLowTof", "TrackerHitsTIDHighTof",
+    "TrackerHitsPixelEndcapLowTof", "TrackerHitsPixelEndcapHighTof",
+    "TrackerHitsTOBLowTof", "TrackerHitsTOBHighTof",
+    "TrackerHitsTECLowTof", "TrackerHitsTECHighTof",
+    "TotemHitsT1", "TotemHitsT2Gem", "TotemHitsRP", "FP420SI", "BSCHits", "PLTHits",
+    "MuonDTHits", "MuonCSCHits", "MuonRPCHits", "MuonGEMHits"
+  };
+  const char * const caloHitNames[] = {
+    "EcalHitsEB", "EcalHitsEE", "EcalHitsES", "HcalHits", "CaloHitsTk",
+    "CastorPL", "CastorFI", "CastorBU", "CastorTU",
+    "EcalTBH4BeamHits", "HcalTB06BeamHits", "ZDCHITS",
+    "ChamberHits", "FibreHits", "WedgeHits"
+  };
+}
+
 // RunManager * RunManager::me = 0;
 /*
 RunManager * RunManager::init(edm::ParameterSet const & p)
@@ -127,6 +161,8 @@ RunManager::RunManager(edm::ParameterSet const & p)
       m_PhysicsTablesDir(p.getParameter<std::string>("PhysicsTablesDirectory")),
       m_StorePhysicsTables(p.getParameter<bool>("StorePhysicsTables")),
       m_RestorePhysicsTables(p.getParameter<bool>("RestorePhysicsTables")),
+      m_StoreRndmSeeds(p.getParameter<bool>("StoreRndmSeeds")),
+      m_RestoreRndmSeeds(p.getParameter<bool>("RestoreRndmSeeds")),
       m_EvtMgrVerbosity(p.getUntrackedParameter<int>("G4EventManagerVerbosity",0)),
       m_Override(p.getParameter<bool>("OverrideUserStackingAction")),
       m_pField(p.getParameter<edm::ParameterSet>("MagneticField")),
@@ -148,6 +184,20 @@ RunManager::RunManager(edm::ParameterSet const & p)
     
   m_check = p.getUntrackedParameter<bool>("CheckOverlap",false);
   m_WriteFile = p.getUntrackedParameter<std::string>("FileNameGDML","");
+  m_UsePhysicsTablesCache = p.getUntrackedParameter<bool>("UsePhysicsTablesCache",false);
+  m_StartupReportFile = p.getUntrackedParameter<std::string>("StartupReportFile","");
+  m_ConvertTracksInParallel = p.getUntrackedParameter<bool>("ConvertTracksInParallel",false);
+  m_RndmSeedsTag = p.getUntrackedParameter<edm::InputTag>("RndmSeedsTag",edm::InputTag("g4SimHits","G4RndmState"));
+  m_hitCollections = p.getUntrackedParameter<std::vector<std::string> >("HitCollections",std::vector<std::string>());
+  std::sort(m_hitCollections.begin(),m_hitCollections.end());
+  for (unsigned int i = 0; i < m_hitCollections.size(); i++) {
+    const std::string & name = m_hitCollections[i];
+    if (std::find(simHitCollections().begin(),simHitCollections().end(),name) == simHitCollections().end() &&
+        std::find(caloHitCollections().begin(),caloHitCollections().end(),name) == caloHitCollections().end())
+      throw cms::Exception("Configuration")
+        << "[SimG4Core RunManager]\n"
+        << "HitCollections: " << name << " is not a hit collection of g4SimHits\n";
+  }
 
   //Look for an outside SimActivityRegistry
   // this is used by the visualization code
@@ -164,6 +214,22 @@ RunManager::~RunManager()
     if (m_kernel!=0) delete m_kernel; 
 }
 
+void RunManager::setChildIndex(unsigned int index)
+{
+  // in multi-process mode every child builds its own Geant4 world in
+  // beginRun; keep the children from writing the same files
+  if ("" != m_StartupReportFile) {
+    std::ostringstream name;
+    name << m_StartupReportFile << "." << index;
+    m_StartupReportFile = name.str();
+  }
+  if (index > 0) {
+    m_StorePhysicsTables = false;
+    m_WriteFile = "";
+  }
+  edm::LogInfo("SimG4CoreApplication") << " RunManager: running in forked child " << index;
+}
+
 void RunManager::initG4(const edm::EventSetup & es)
 {
 
@@ -187,6 +253,7 @@ void RunManager::initG4(const edm::EventSetup & es)
   if (m_managerInitialized) return;
   
   // DDDWorld: get the DDCV from the ES and use it to build the World
+  m_startupProfiler.start("DDDWorld");
   edm::ESTransientHandle<DDCompactView> pDD;
   es.get<IdealGeometryRecord>().get(pDD);
    
@@ -196,6 +263,7 @@ void RunManager::initG4(const edm::EventSetup & es)
   m_registry.dddWorldSignal_(world);
 
   if("" != m_WriteFile) {
+    m_startupProfiler.start("WriteGDML");
     G4GDMLParser gdml;
     gdml.Write(m_WriteFile, world->GetWorldVolume());
   }
@@ -203,12 +271,26 @@ void RunManager::initG4(const edm::EventSetup & es)
   if (m_pUseMagneticField)
     {
       // setup the magnetic field
+      m_startupProfiler.start("MagneticField");
       edm::ESHandle<MagneticField> pMF;
       es.get<IdealMagneticFieldRecord>().get(pMF);
       const GlobalPoint g(0.,0.,0.);
 
+      const MagneticField * field = &(*pMF);
+      if (m_pField.getUntrackedParameter<bool>("UseFieldCache",false)) 
+        {
+          m_startupProfiler.start("FieldCache");
+          // the producer of the field and its configuration (map version,
+          // scaling) tell the grids of different field maps apart
+          std::ostringstream fieldLabel;
+          const edm::eventsetup::ComponentDescription * desc = pMF.description();
+          if (desc != 0) fieldLabel << desc->type_ << ' ' << desc->label_ << ' ' << desc->pid_;
+          if (createFieldCache(field, fieldLabel.str())) field = m_fieldCache.get();
+        }
+      m_startupProfiler.start("FieldBuilder");
+
       // m_fieldBuilder = std::auto_ptr<sim::FieldBuilder>(new sim::FieldBuilder(&(*pMF), map_, m_pField));
-      m_fieldBuilder = (new sim::FieldBuilder(&(*pMF), m_pField));
+      m_fieldBuilder = (new sim::FieldBuilder(field, m_pField));
       G4TransportationManager * tM = 
 	G4TransportationManager::GetTransportationManager();
       m_fieldBuilder->build( tM->GetFieldManager(),tM->GetPropagatorInField());
@@ -217,7 +299,9 @@ void RunManager::initG4(const edm::EventSetup & es)
 
   // we need the track manager now
   m_trackManager = std::auto_ptr<SimTrackManager>(new SimTrackManager);
+  m_trackManager->setConvertInParallel(m_ConvertTracksInParallel);
 
+  m_startupProfiler.start("AttachSD");
   m_attach = new AttachSD;
   {
     std::pair< std::vector<SensitiveTkDetector*>,
@@ -227,19 +311,29 @@ void RunManager::initG4(const edm::EventSetup & es)
     m_sensCaloDets.swap(sensDets.second);
   }
 
+  // an SD none of whose collections is produced (HitCollections) is
+  // switched off, Geant4 then no longer gives it the steps
+  for (unsigned int i = 0; i < m_sensTkDets.size(); i++)
+    if (!producesHits(m_sensTkDets[i]->getNames())) deactivate(m_sensTkDets[i]);
+  for (unsigned int i = 0; i < m_sensCaloDets.size(); i++)
+    if (!producesHits(m_sensCaloDets[i]->getNames())) deactivate(m_sensCaloDets[i]);
+
     
   edm::LogInfo("SimG4CoreApplication") << " RunManager: Sensitive Detector building finished; found " << m_sensTkDets.size()
                                        << " Tk type Producers, and " << m_sensCaloDets.size() << " Calo type producers ";
 
+  m_startupProfiler.start("ParticleDataTable");
   edm::ESHandle<HepPDT::ParticleDataTable> fTable;
   es.get<PDTRecord>().get(fTable);
   const HepPDT::ParticleDataTable *fPDGTable = &(*fTable);
 
+  m_startupProfiler.start("Generator");
   m_generator = new Generator(m_pGenerator);
   // m_InTag = m_pGenerator.getParameter<edm::InputTag>("HepMCProductLabel") ;
   m_InTag = m_pGenerator.getParameter<std::string>("HepMCProductLabel") ;
   m_primaryTransformer = new PrimaryTransformer();
 
+  m_startupProfiler.start("PhysicsList");
   std::auto_ptr<PhysicsListMakerBase> physicsMaker( 
                                                    PhysicsListFactory::get()->create
                                                    (m_pPhysics.getParameter<std::string> ("type")));
@@ -254,18 +348,44 @@ void RunManager::initG4(const edm::EventSetup & es)
   // on top of any Physics Lists
   phys->RegisterPhysics(new ParametrisedEMPhysics("EMoptions",m_pPhysics));
   
+  m_startupProfiler.start("InitializePhysics");
   m_kernel->SetPhysics(phys);
   m_kernel->InitializePhysics();
 
   m_physicsList->ResetStoredInAscii();
   std::string tableDir = m_PhysicsTablesDir;
-  if (m_RestorePhysicsTables) m_physicsList->SetPhysicsTableRetrieved(tableDir);
+  bool storeTables = m_StorePhysicsTables;
+  bool fillCache = false;
+  if (m_UsePhysicsTablesCache)
+    {
+      // the cache entry is a sub-directory named after the configuration
+      // key; it only appears (by rename) once all tables are written,
+      // so an existing entry is always complete
+      tableDir = m_PhysicsTablesDir + "/" + physicsTablesKey();
+      struct stat entry;
+      if (stat(tableDir.c_str(), &entry) == 0 && S_ISDIR(entry.st_mode))
+        {
+          edm::LogInfo("SimG4CoreApplication") << " RunManager: physics tables restored from cache "
+                                               << tableDir;
+          m_physicsList->SetPhysicsTableRetrieved(tableDir);
+        }
+      else
+        {
+          edm::LogInfo("SimG4CoreApplication") << " RunManager: no physics tables in cache for "
+                                               << tableDir << ", they will be built and stored";
+          fillCache = true;
+        }
+      storeTables = false;
+    }
+  else if (m_RestorePhysicsTables) m_physicsList->SetPhysicsTableRetrieved(tableDir);
  
+  m_startupProfiler.start("RunInitialization");
   if (m_kernel->RunInitialization()) m_managerInitialized = true;
   else throw SimG4Exception("G4RunManagerKernel initialization failed!");
   
-  if (m_StorePhysicsTables)
+  if (storeTables)
     {
+      m_startupProfiler.start("StorePhysicsTables");
       std::ostringstream dir;
       dir << tableDir << '\0';
       std::string cmd = std::string("/control/shell mkdir -p ")+tableDir;
@@ -273,13 +393,29 @@ void RunManager::initG4(const edm::EventSetup & es)
         G4UImanager::GetUIpointer()->ApplyCommand(cmd);
       m_physicsList->StorePhysicsTable(tableDir);
     }
+
+  if (fillCache)
+    {
+      // write into a private directory first, concurrent jobs may be
+      // filling the same entry; the first rename wins
+      m_startupProfiler.start("StorePhysicsTables");
+      std::ostringstream tmpDir;
+      tmpDir << tableDir << ".tmp" << getpid();
+      G4UImanager::GetUIpointer()->ApplyCommand("/control/shell mkdir -p "+tmpDir.str());
+      m_physicsList->StorePhysicsTable(tmpDir.str());
+      if (std::rename(tmpDir.str().c_str(), tableDir.c_str()) != 0)
+        G4UImanager::GetUIpointer()->ApplyCommand("/control/shell rm -rf "+tmpDir.str());
+    }
   
   //tell all interesting parties that we are beginning the job
+  m_startupProfiler.start("BeginOfJob");
   BeginOfJob aBeginOfJob(&es);
   m_registry.beginOfJobSignal_(&aBeginOfJob);
   
+  m_startupProfiler.start("UserActions");
   initializeUserActions();
   
+  m_startupProfiler.start("G4Commands");
   for (unsigned it=0; it<m_G4Commands.size(); it++) {
     edm::LogInfo("SimG4CoreApplication") << "RunManager:: Requests UI: "
                                          << m_G4Commands[it];
@@ -291,15 +427,26 @@ void RunManager::initG4(const edm::EventSetup & es)
   //  G4cout << "Output of G4ParticleTable DumpTable:" << G4endl;
   //  G4ParticleTable::GetParticleTable()->DumpTable("ALL");
   
+  m_startupProfiler.start("InitializeRun");
   initializeRun();
   firstRun= false;
 
+  m_startupProfiler.stop();
+  m_startupProfiler.report(m_StartupReportFile);
+
 }
 
 void RunManager::produce(edm::Event& inpevt, const edm::EventSetup & es)
 {
+    // the engine state at the start of the event is enough to
+    // re-simulate this event alone
+    CLHEP::HepRandomEngine * engine = CLHEP::HepRandom::getTheEngine();
+    if (m_RestoreRndmSeeds) restoreRandomState(inpevt, engine);
+    if (m_StoreRndmSeeds) m_randomState = engine->put();
+
     m_currentEvent = generateEvent(inpevt);
     m_simEvent = new G4SimEvent;
+    m_simEvent->loadInParallel(m_ConvertTracksInParallel);
     m_simEvent->hepEvent(m_generator->genEvent());
     m_simEvent->weight(m_generator->eventWeight());
     if (m_generator->genVertex()!=0) 
@@ -494,12 +641,132 @@ void RunManager::abortRun(bool softAbort)
     
 }
 
+const std::vector<std::string> & RunManager::simHitCollections()
+{
+  static const std::vector<std::string> names(simHitNames,simHitNames+sizeof(simHitNames)/sizeof(simHitNames[0]));
+  return names;
+}
+
+const std::vector<std::string> & RunManager::caloHitCollections()
+{
+  static const std::vector<std::string> names(caloHitNames,caloHitNames+sizeof(caloHitNames)/sizeof(caloHitNames[0]));
+  return names;
+}
+
+bool RunManager::producesHitCollection(const std::string & name) const
+{
+  return m_hitCollections.empty() ||
+    std::binary_search(m_hitCollections.begin(),m_hitCollections.end(),name);
+}
+
+bool RunManager::producesHits(const std::vector<std::string> & names) const
+{
+  for (unsigned int i = 0; i < names.size(); i++)
+    if (producesHitCollection(names[i])) return true;
+  return false;
+}
+
+void RunManager::deactivate(G4VSensitiveDetector * sd)
+{
+  sd->Activate(false);
+  edm::LogInfo("SimG4CoreApplication") << " RunManager: sensitive detector " << sd->GetName()
+                                       << " switched off, none of its hit collections is produced";
+}
+
+bool RunManager::createFieldCache(const MagneticField * field, const std::string & fieldLabel)
+{
+  double rMax      = m_pField.getUntrackedParameter<double>("FieldCacheRMax",130.0);
+  double zMax      = m_pField.getUntrackedParameter<double>("FieldCacheZMax",300.0);
+  double step      = m_pField.getUntrackedParameter<double>("FieldCacheStep",5.0);
+  double tolerance = m_pField.getUntrackedParameter<double>("FieldCacheTolerance",0.001);
+  m_fieldCache = std::auto_ptr<CachedMagneticField>(new CachedMagneticField(field,rMax,zMax,step));
+
+  // the grid is stored next to the physics tables, named after the field
+  // it was built from; a stored grid is only used if it still agrees
+  // with the field on a sample of cells
+  std::ostringstream key;
+  key << fieldLabel << ' ' << m_pField.toString() << ' ' << rMax << ' ' << zMax << ' ' << step;
+  cms::Digest digest(key.str());
+  std::string fileName = m_PhysicsTablesDir + "/MagneticFieldCache_" + digest.digest().toString() + ".bin";
+  if (m_fieldCache->read(fileName) && m_fieldCache->maxDeviation(97) < tolerance)
+    {
+      edm::LogInfo("SimG4CoreApplication") << " RunManager: magnetic field grid read from " << fileName;
+      return true;
+    }
+
+  m_fieldCache->build();
+  double deviation = m_fieldCache->maxDeviation(1);
+  if (deviation >= tolerance)
+    {
+      edm::LogWarning("SimG4CoreApplication") << " RunManager: magnetic field grid with step " << step
+                                              << " cm deviates by up to " << deviation 
+                                              << " T from the field (tolerance " << tolerance 
+                                              << " T), the full field is used";
+      m_fieldCache.reset();
+      return false;
+    }
+  edm::LogInfo("SimG4CoreApplication") << " RunManager: magnetic field grid of " << m_fieldCache->size()
+                                       << " nodes built, maximal deviation " << deviation << " T";
+
+  std::ostringstream tmpName;
+  tmpName << fileName << ".tmp" << getpid();
+  G4UImanager::GetUIpointer()->ApplyCommand("/control/shell mkdir -p "+m_PhysicsTablesDir);
+  if (m_fieldCache->write(tmpName.str())) std::rename(tmpName.str().c_str(), fileName.c_str());
+  else std::remove(tmpName.str().c_str());
+  return true;
+}
+
+std::string RunManager::physicsTablesKey() const
+{
+  std::ostringstream cuts;
+  cuts.precision(17);
+  cuts << G4VERSION_NUMBER << ' ' << G4Version << '\n';
+  // the tables are per material-cuts couple: the materials of each
+  // region count as much as its cuts. The kernel only fills the region
+  // material lists in RunInitialization, so do it here for the world
+  G4RegionStore * rs = G4RegionStore::GetInstance();
+  rs->UpdateMaterialList(G4TransportationManager::GetTransportationManager()
+                         ->GetNavigatorForTracking()->GetWorldVolume());
+  for (std::vector<G4Region*>::const_iterator rcite = rs->begin(); rcite != rs->end(); rcite++)
+    {
+      cuts << (*rcite)->GetName();
+      const G4ProductionCuts * pcuts = (*rcite)->GetProductionCuts();
+      if (pcuts!=0)
+        for (int i=0; i<NumberOfG4CutIndex; i++) cuts << ' ' << pcuts->GetProductionCut(i);
+      std::vector<G4Material*>::const_iterator mItr = (*rcite)->GetMaterialIterator();
+      for (size_t i=0; i<(*rcite)->GetNumberOfMaterials(); i++, mItr++)
+        cuts << ' ' << (*mItr)->GetName() << ' ' << (*mItr)->GetDensity();
+      cuts << '\n';
+    }
+
+  // untracked parameters (verbosities) do not change the tables
+  cms::Digest digest(m_pPhysics.trackedPart().toString());
+  digest.append(cuts.str());
+  return digest.digest().toString();
+}
+
+void RunManager::restoreRandomState( edm::Event& inpevt, CLHEP::HepRandomEngine * engine ) {
+
+  edm::Handle<std::vector<unsigned long> > state;
+  inpevt.getByLabel( m_RndmSeedsTag, state );
+  if ( !state.isValid() || !engine->get(*state) ) {
+    throw cms::Exception("BadConfig") 
+      << "[SimG4Core RunManager]\n"
+      << "RestoreRndmSeeds is set but no valid random engine state " << m_RndmSeedsTag
+      << "\nwas found for event " << inpevt.id() << "\n";
+  }
+  edm::LogInfo("SimG4CoreApplication") << " RunManager: random engine state restored for event " 
+                                       << inpevt.id();
+
+}
+
 void RunManager::resetGenParticleId( edm::Event& inpevt ) {
 
   edm::Handle<edm::LHCTransportLinkContainer> theLHCTlink;
   inpevt.getByLabel( m_theLHCTlinkTag, theLHCTlink );
   if ( theLHCTlink.isValid() ) {
-    m_trackManager->setLHCTransportLink( theLHCTlink.product() );
+    SimTrackManager::fillLHCTransportLinkMap( *theLHCTlink, m_theLHCTlinkMap );
+    m_trackManager->setLHCTransportLink( &m_theLHCTlinkMap );
   }
 
 }
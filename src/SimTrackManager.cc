@@ -12,20 +12,93 @@
 //
 
 // system include files
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <type_traits>
 
 // user include files
 #include "SimG4Core/Application/interface/SimTrackManager.h"
 #include "SimG4Core/Application/interface/G4SimTrack.h"
 #include "SimG4Core/Application/interface/G4SimVertex.h"
+#include "SimG4Core/Notification/interface/SimG4Exception.h"
 
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
+#include <sys/mman.h>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
 //#define DebugLog
 
 //
 // constants, enums and typedefs
 //
+namespace {
+  // distance (mm) below which two vertices of the same parent are merged
+  const double vertexTolerance = 0.001;
+
+  bool cleanedTrackLess(const std::pair<unsigned int,int> & a, const std::pair<unsigned int,int> & b) {
+    return a.first < b.first;
+  }
+
+  bool trackRecordLess(const SimTrackManager::TrackRecord & a, const SimTrackManager::TrackRecord & b) {
+    return a.trackID < b.trackID;
+  }
+
+  void pack(const TrackWithHistory & trk, SimTrackManager::PackedTrack & packed) {
+    packed.trackID = trk.trackID();
+    packed.parentID = trk.parentID();
+    packed.particleID = trk.particleID();
+    packed.genParticleID = trk.genParticleID();
+    packed.momentum[0] = trk.momentum().x();
+    packed.momentum[1] = trk.momentum().y();
+    packed.momentum[2] = trk.momentum().z();
+    packed.energy = trk.totalEnergy();
+    packed.vertexPosition[0] = trk.vertexPosition().x();
+    packed.vertexPosition[1] = trk.vertexPosition().y();
+    packed.vertexPosition[2] = trk.vertexPosition().z();
+    packed.globalTime = trk.globalTime();
+  }
+
+  /// same result as stable_sort of a range made of few ordered runs: the
+  /// runs are found in one pass (strictly descending ones are reversed)
+  /// and merged pairwise. An ordered range costs one pass, k runs cost
+  /// O(n log k). Returns false if the range was ordered already
+  template <class Iter, class Less>
+  bool mergeOrderedRuns(Iter begin, Iter end, Less less, std::vector<unsigned int> & bounds) {
+    bounds.clear();
+    Iter it = begin;
+    bool ordered = true;
+    while (it != end) {
+      bounds.push_back(it-begin);
+      Iter next = it+1;
+      if (next != end && less(*next,*it)) {
+        while (next != end && less(*next,*(next-1))) ++next;
+        std::reverse(it,next);
+        ordered = false;
+      } else {
+        while (next != end && !less(*next,*(next-1))) ++next;
+      }
+      it = next;
+    }
+    bounds.push_back(end-begin);
+    if (bounds.size() > 2) ordered = false;
+
+    while (bounds.size() > 2) {
+      unsigned int i = 0, nMerged = 0;
+      for (; i+2 < bounds.size(); i += 2) {
+        std::inplace_merge(begin+bounds[i],begin+bounds[i+1],begin+bounds[i+2],less);
+        bounds[nMerged++] = bounds[i];
+      }
+      if (i+1 < bounds.size()) bounds[nMerged++] = bounds[i];
+      bounds[nMerged++] = bounds.back();
+      bounds.resize(nMerged);
+    }
+    return !ordered;
+  }
+}
 
 //
 // static data member definitions
@@ -37,12 +110,17 @@
 SimTrackManager::SimTrackManager(bool iCollapsePrimaryVertices) :
   m_trksForThisEvent(0),m_nVertices(0),
   m_collapsePrimaryVertices(iCollapsePrimaryVertices),
-  lastTrack(0),lastHist(0),theLHCTlink(0){}
+  lastTrack(0),lastHist(0),m_maxHistoryMemory(0),m_spillFile(0),m_nSpilled(0),
+  m_spilledTracks(0),
+  m_maxTrackID(0),m_maxTrackIDKept(0),m_shrinkAfterEvents(0),m_nSmallEvents(0),
+  m_streamPrimaries(false),m_convertInParallel(false),
+  theLHCTlink(0){}
 
 
 SimTrackManager::~SimTrackManager()
 {
   if ( m_trksForThisEvent != 0 ) deleteTracks() ;
+  closeSpillFile();
 }
 
 //
@@ -62,56 +140,118 @@ SimTrackManager::~SimTrackManager()
 //
 void SimTrackManager::reset()
 {
-  if (m_trksForThisEvent==0) m_trksForThisEvent = new TrackContainer();
-  else
-    {
-      for (unsigned int i = 0; i < m_trksForThisEvent->size(); i++) 
-        delete (*m_trksForThisEvent)[i];
-      delete m_trksForThisEvent;
-      m_trksForThisEvent = new TrackContainer();
-    }
+  // the tracks of an event which did not reach deleteTracks
+  for (unsigned int i = 0; i < m_trackContainer.size(); i++) 
+    delete m_trackContainer[i];
+  m_trackContainer.clear();
+  m_trksForThisEvent = &m_trackContainer;
+  m_packedTracks.clear();
   cleanVertexMap();
   cleanTkCaloStateInfoMap();
-  std::vector<std::pair <int, int> >().swap(idsave);
+  idsave.clear();
   ancestorList.clear();
+  m_inHistory.clear();
+  m_cleanedTracks.clear();
+  closeSpillFile();
   lastTrack=0;
   lastHist=0;
+
+  // everything above kept its capacity; give it back once the events
+  // have been much smaller than the largest one for a while
+  if (m_maxTrackID > m_maxTrackIDKept) m_maxTrackIDKept = m_maxTrackID;
+  if (m_shrinkAfterEvents > 0 && 4*m_maxTrackID < m_maxTrackIDKept) {
+    if (++m_nSmallEvents >= m_shrinkAfterEvents) releaseMemory();
+  } else {
+    m_nSmallEvents = 0;
+  }
+  m_maxTrackID = 0;
+}
+
+void SimTrackManager::releaseMemory()
+{
+  TrackContainer().swap(m_trackContainer);
+  VertexMap().swap(m_vertexMap);
+  mapTkCaloStateInfo.release();
+  idsave.release();
+  ancestorList.release();
+  m_inHistory.release();
+  std::vector<std::pair<unsigned int,int> >().swap(m_cleanedTracks);
+  std::vector<PackedTrack>().swap(m_packedTracks);
+  m_trackIndex.release();
+  std::vector<TrackRecord>().swap(m_trackRecords);
+  TrackContainer().swap(m_sortedTracks);
+  m_maxTrackIDKept = m_maxTrackID;
+  m_nSmallEvents = 0;
+#ifdef DebugLog
+  LogDebug("SimTrackManager") << " SimTrackManager::releaseMemory after " << m_shrinkAfterEvents 
+                              << " small events";
+#endif
 }
 
 void SimTrackManager::deleteTracks()
 {
   for (unsigned int i = 0; i < m_trksForThisEvent->size(); i++) delete (*m_trksForThisEvent)[i];
-  delete m_trksForThisEvent;
+  m_trksForThisEvent->clear();
   m_trksForThisEvent = 0;
+  m_inHistory.clear();
 }
 
-/// this saves a track and all its parents looping over the non ordered vector
-void SimTrackManager::saveTrackAndItsBranch(TrackWithHistory * trkWHist)
+/// this saves a track of m_trackRecords and all its parents looping over the non ordered history
+void SimTrackManager::saveTrackAndItsBranch(unsigned int iRecord)
 {
-  using namespace std;
-  TrackWithHistory * trkH = trkWHist;
-  if (trkH == 0)
-    {
-      edm::LogError("SimTrackManager") << " SimTrackManager::saveTrackAndItsBranch got 0 pointer ";
-      abort();
+  m_trackRecords[iRecord].saved = true;
+  unsigned int parent = m_trackRecords[iRecord].parentID;
+
+  // lower_bound over the history: the tracks already cleaned, known by
+  // m_cleanedTracks even when spilled, then the new ones
+  unsigned int nHistory = lastTrack + m_trackRecords.size();
+  for (;;) {
+    unsigned int first = 0, len = nHistory;
+    while (len > 0) {
+      unsigned int half = len >> 1, middle = first + half;
+      unsigned int id = (middle < lastTrack) ? m_cleanedTracks[middle].first :
+        m_trackRecords[middle-lastTrack].trackID;
+      if (id < parent) { first = middle + 1; len -= half + 1; }
+      else len = half;
+    }
+    if (first == nHistory) break;
+    if (first < lastTrack) {
+      // already cleaned, hence already saved
+      if (m_cleanedTracks[first].first != parent) break;
+      parent = m_cleanedTracks[first].second;
+    } else {
+      TrackRecord & record = m_trackRecords[first-lastTrack];
+      if (record.trackID != parent) break;
+      record.saved = true;
+      parent = record.parentID;
     }
-  trkH->save();
-  unsigned int parent = trkH->parentID();
-  bool parentExists=false;
+  }
   
-  TrackContainer::const_iterator tk_itr = std::lower_bound((*m_trksForThisEvent).begin(),(*m_trksForThisEvent).end(),
-                                                           parent,SimTrackManager::StrictWeakOrdering());
+}
 
-  TrackWithHistory * tempTk = *tk_itr;
-  //  TrackWithHistory * tempTk = new TrackWithHistory(**tk_itr);
-  if (tk_itr!=m_trksForThisEvent->end() && (*tk_itr)->trackID()==parent) { 
-    parentExists=true;  
+/// same result as stable_sort by track ID of the container from
+/// position first on, which is made of few ordered runs: every primary
+/// appends its tracks in order. The runs are merged on the compact
+/// m_trackRecords and the pointers are permuted once at the end.
+/// m_trackRecords is left in the new order
+void SimTrackManager::sortByTrackID(unsigned int first)
+{
+  unsigned int n = m_trksForThisEvent->size() - first;
+  m_trackRecords.resize(n);
+  for (unsigned int i = 0; i < n; i++) {
+    const TrackWithHistory * t = (*m_trksForThisEvent)[first+i];
+    TrackRecord & record = m_trackRecords[i];
+    record.trackID  = t->trackID();
+    record.parentID = t->parentID();
+    record.position = first+i;
+    record.saved    = t->saved();
   }
-  
-  if (parentExists) saveTrackAndItsBranch(tempTk);
-  
-  //  delete tempTk;
-  
+
+  if (!mergeOrderedRuns(m_trackRecords.begin(),m_trackRecords.end(),trackRecordLess,m_runBounds)) return;
+
+  m_sortedTracks.resize(n);
+  for (unsigned int i = 0; i < n; i++) m_sortedTracks[i] = (*m_trksForThisEvent)[m_trackRecords[i].position];
+  std::copy(m_sortedTracks.begin(),m_sortedTracks.end(),m_trksForThisEvent->begin()+first);
 }
 
 void SimTrackManager::storeTracks(G4SimEvent* simEvent)
@@ -120,106 +260,205 @@ void SimTrackManager::storeTracks(G4SimEvent* simEvent)
 
   // fill the map with the final mother-daughter relationship
   idsave.swap(ancestorList);
-  stable_sort(idsave.begin(),idsave.end());
-
-  std::vector<std::pair<int,int> >().swap(ancestorList);
+  ancestorList.clear();
 
   // to get a backward compatible order
-  stable_sort(m_trksForThisEvent->begin(),m_trksForThisEvent->end(),trkIDLess());
+  // each primary has left its tracks ordered, only these runs are merged
+  sortByTrackID(0);
 
   // to reset the GenParticle ID of a SimTrack to its pre-LHCTransport value
   resetGenID();
 
   reallyStoreTracks(simEvent);
+  theLHCTlink = 0;
+}
+
+/// the cleaned tracks in memory, all of a finished primary, are packed
+/// after the ones packed already and leave the container
+void SimTrackManager::packTracks()
+{
+  // as storeTracks does for the tracks left in the container
+  resetGenID();
+
+  unsigned int first = m_packedTracks.size();
+  unsigned int nTracks = m_trksForThisEvent->size();
+  m_packedTracks.resize(first+nTracks);
+  for (unsigned int it = 0; it < nTracks; it++)
+    {
+      pack(*(*m_trksForThisEvent)[it],m_packedTracks[first+it]);
+      delete (*m_trksForThisEvent)[it];
+    }
+  m_trksForThisEvent->clear();
+
+#ifdef DebugLog
+  LogDebug("SimTrackManager") << " SimTrackManager::packTracks " << nTracks << " tracks, " 
+                              << m_packedTracks.size() << " packed";
+#endif
+}
+
+const SimTrackManager::PackedTrack & SimTrackManager::packedTrack(unsigned int position, PackedTrack & buffer) const
+{
+  if (position < m_nSpilled) return m_spilledTracks[position];
+  position -= m_nSpilled;
+  if (position < m_packedTracks.size()) return m_packedTracks[position];
+  pack(*(*m_trksForThisEvent)[position-m_packedTracks.size()],buffer);
+  return buffer;
 }
 
 void SimTrackManager::reallyStoreTracks(G4SimEvent * simEvent)
 {
-  // loop over the (now ordered) vector and really save the tracks
+  // the spilled tracks are converted from the file, never read back
+  // into the container
+  std::size_t spilledLength = std::size_t(m_nSpilled)*sizeof(PackedTrack);
+  if (m_nSpilled > 0) {
+    void * records = mmap(0,spilledLength,PROT_READ,MAP_PRIVATE,fileno(m_spillFile),0);
+    if (records == MAP_FAILED)
+      throw SimG4Exception("SimTrackManager: cannot read back the spilled track history");
+    m_spilledTracks = static_cast<const PackedTrack *>(records);
+  }
+
+  // the spilled tracks, the packed ones, then the container: each primary
+  // has left its tracks ordered, only these runs are merged to order them
+  // all by ID
+  unsigned int nTracks = m_nSpilled + m_packedTracks.size() + m_trksForThisEvent->size();
 #ifdef DebugLog
   LogDebug("SimTrackManager")  << "Inside the reallyStoreTracks method object to be stored = " 
-                               << m_trksForThisEvent->size();
+                               << nTracks;
 #endif 
- 
-  for (unsigned int it = 0; it < m_trksForThisEvent->size(); it++)
+  m_trackRecords.resize(nTracks);
+  PackedTrack buffer;
+  for (unsigned int it = 0; it < nTracks; it++)
     {
-      TrackWithHistory * trkH = (*m_trksForThisEvent)[it];
-      // at this stage there is one vertex per track, so the vertex id of track N is also N
-      int ivertex = -1;
-      int ig;
-      
-      math::XYZVectorD pm(0.,0.,0.);
-      unsigned int iParentID = trkH->parentID();
-      for(unsigned int iit = 0; iit < m_trksForThisEvent->size(); iit++)
-        {
-          if((*m_trksForThisEvent)[iit]->trackID()==iParentID){
-            pm = (*m_trksForThisEvent)[iit]->momentum();
-            break;
-          }
+      const PackedTrack & trk = packedTrack(it,buffer);
+      TrackRecord & record = m_trackRecords[it];
+      record.trackID  = trk.trackID;
+      record.parentID = trk.parentID;
+      record.position = it;
+      record.saved    = true;
+    }
+  mergeOrderedRuns(m_trackRecords.begin(),m_trackRecords.end(),trackRecordLess,m_runBounds);
+  m_trackIndex.clear();
+  for (unsigned int it = 0; it < nTracks; it++) m_trackIndex.set(m_trackRecords[it].trackID,it);
+
+  // first pass: the tracks are independent of each other and only read
+  // the history
+  std::vector<G4SimTrack> g4tracks(nTracks);
+  auto convert = [&](const tbb::blocked_range<unsigned int> & range) {
+    PackedTrack buffer, parentBuffer;
+    for (unsigned int it = range.begin(); it != range.end(); it++)
+      {
+        const PackedTrack & trk = packedTrack(m_trackRecords[it].position,buffer);
+        int ig;
+
+        math::XYZVectorD pm(0.,0.,0.);
+        int iParent = m_trackIndex[trk.parentID];
+        if (iParent >= 0) {
+          const PackedTrack & parent = packedTrack(m_trackRecords[iParent].position,parentBuffer);
+          pm = math::XYZVectorD(parent.momentum[0],parent.momentum[1],parent.momentum[2]);
+        }
+        ig = trk.genParticleID;
+        const TkCaloStateInfoMap::TkCaloStateInfo * cit = mapTkCaloStateInfo.find(trk.trackID);
+        TkCaloStateInfoMap::TkCaloStateInfo tcinfo;
+        if (cit != 0){
+          tcinfo = *cit;
         }
-      ig = trkH->genParticleID();
-      ivertex = getOrCreateVertex(trkH,iParentID,simEvent);
-      std::map<uint32_t,std::pair<math::XYZVectorD,math::XYZTLorentzVectorD> >::const_iterator cit = mapTkCaloStateInfo.find(trkH->trackID());
-      std::pair<math::XYZVectorD,math::XYZTLorentzVectorD> tcinfo;
-      if (cit !=  mapTkCaloStateInfo.end()){
-        tcinfo = cit->second;
+        g4tracks[it] = G4SimTrack(trk.trackID,trk.particleID,
+                                  math::XYZVectorD(trk.momentum[0],trk.momentum[1],trk.momentum[2]),
+                                  trk.energy,-1,ig,pm,tcinfo.first,tcinfo.second);
       }
-      simEvent->add(new G4SimTrack(trkH->trackID(),trkH->particleID(),
-                                   trkH->momentum(),trkH->totalEnergy(),ivertex,ig,pm,tcinfo.first,tcinfo.second));
+  };
+  tbb::blocked_range<unsigned int> allTracks(0,nTracks,G4SimEvent::grainSize);
+  if (m_convertInParallel) tbb::parallel_for(allTracks,convert);
+  else convert(allTracks);
+
+  // second pass, in order: a vertex is merged into the first one of the
+  // same parent at the same place, so the numbering depends on the order
+  for (unsigned int it = 0; it < nTracks; it++)
+    {
+      const PackedTrack & trk = packedTrack(m_trackRecords[it].position,buffer);
+      math::XYZVectorD pos(trk.vertexPosition[0],trk.vertexPosition[1],trk.vertexPosition[2]);
+      g4tracks[it].setIvert(getOrCreateVertex(pos,trk.globalTime,trk.parentID,simEvent));
     }
+
+  simEvent->addTracks(g4tracks);
+
+  if (m_spilledTracks != 0) munmap(const_cast<PackedTrack *>(m_spilledTracks),spilledLength);
+  m_spilledTracks = 0;
+  closeSpillFile();
 }
 
-int SimTrackManager::getOrCreateVertex(TrackWithHistory * trkH, int iParentID,
+int SimTrackManager::getOrCreateVertex(const math::XYZVectorD & pos, double time, int iParentID,
                                        G4SimEvent * simEvent){
   
+  // the parent must be a stored track
   int parent = iParentID;
-  int check = -1;
-  
-  for( std::vector<TrackWithHistory*>::const_iterator it = (*m_trksForThisEvent).begin(); 
-       it!= (*m_trksForThisEvent).end();it++){
-    if ((*it)->trackID() == uint32_t(parent)){
-      check = 0;
-      break;
-    }
-  }
+  if (m_trackIndex[parent] < 0) parent = -1;
   
-  if(check==-1) parent = -1;
-  
-  VertexMap::const_iterator iterator = m_vertexMap.find(parent);
-  if (iterator != m_vertexMap.end()){
-    // loop over saved vertices
-    for (unsigned int k=0; k<m_vertexMap[parent].size(); k++){
-      if (sqrt((trkH->vertexPosition()-(((m_vertexMap[parent])[k]).second)).Mag2())<0.001)
-        return (((m_vertexMap[parent])[k]).first);
+  // vertices of the same parent closer than vertexTolerance are merged;
+  // they can only be in the 27 cells around this one. Keep the lowest
+  // number, i.e. the vertex which was created first
+  VertexCell cell = vertexCell(parent,pos);
+  int ivertex = -1;
+  VertexCell near = cell;
+  for (near.ix = cell.ix-1; near.ix <= cell.ix+1; near.ix++) {
+    for (near.iy = cell.iy-1; near.iy <= cell.iy+1; near.iy++) {
+      for (near.iz = cell.iz-1; near.iz <= cell.iz+1; near.iz++) {
+        VertexMap::const_iterator iterator = m_vertexMap.find(near);
+        if (iterator == m_vertexMap.end()) continue;
+        const MapVertexPositionVector & vertices = iterator->second;
+        for (unsigned int k=0; k<vertices.size(); k++){
+          if ((ivertex < 0 || vertices[k].first < ivertex) &&
+              sqrt((pos-vertices[k].second).Mag2()) < vertexTolerance)
+            ivertex = vertices[k].first;
+        }
+      }
     }
   }
+  if (ivertex >= 0) return ivertex;
   
-  simEvent->add(new G4SimVertex(trkH->vertexPosition(),trkH->globalTime(),parent));
-  m_vertexMap[parent].push_back(MapVertexPosition(m_nVertices,trkH->vertexPosition()));
+  simEvent->add(G4SimVertex(pos,time,parent));
+  m_vertexMap[cell].push_back(MapVertexPosition(m_nVertices,pos));
   m_nVertices++;
   return (m_nVertices-1);
   
 }
 
+SimTrackManager::VertexCell SimTrackManager::vertexCell(int parent, const math::XYZVectorD & pos) const {
+  VertexCell cell;
+  cell.parent = parent;
+  cell.ix = (long long)(std::floor(pos.x()/(2.*vertexTolerance)));
+  cell.iy = (long long)(std::floor(pos.y()/(2.*vertexTolerance)));
+  cell.iz = (long long)(std::floor(pos.z()/(2.*vertexTolerance)));
+  return cell;
+}
+
 void SimTrackManager::cleanVertexMap() { 
   m_vertexMap.clear();
-  MotherParticleToVertexMap().swap(m_vertexMap);
   m_nVertices=0; 
 }
 
 void SimTrackManager::cleanTkCaloStateInfoMap() { 
   mapTkCaloStateInfo.clear();
-  std::map<uint32_t,std::pair<math::XYZVectorD,math::XYZTLorentzVectorD > >().swap(mapTkCaloStateInfo);
 }
 
-int SimTrackManager::idSavedTrack (int i) const
+int SimTrackManager::idSavedTrack (int i)
 {
 
-  int id = 0;  
-  if (i > 0) {
-    for (unsigned int itr=0; itr<idsave.size(); itr++) { if ((idsave[itr]).first == i) { id = (idsave[itr]).second; break; } }
-      if (id != i) return idSavedTrack(id);
-      id = i;
+  // a saved track is its own entry; going up from i, the first one found
+  // is the answer, 0 if the chain leaves the current primary
+  int id = i;
+  while (id > 0) {
+    int parent = idsave[id];
+    if (parent == id) break;
+    id = (parent > 0) ? parent : 0;
+  }
+
+  // point the tracks on the way directly to the answer
+  for (int it = i; it > 0 && it != id; ) {
+    int parent = idsave[it];
+    if (parent < 0) break;
+    idsave.set(it,id);
+    it = parent;
   }
   return id;
 }
@@ -227,21 +466,22 @@ int SimTrackManager::idSavedTrack (int i) const
 
 void SimTrackManager::fillMotherList() {
 
-  if ( ancestorList.size() > 0 && lastHist > ancestorList.size() ) {
-    lastHist = ancestorList.size();
+  if ( !ancestorList.empty() && lastHist > ancestorList.ids().size() ) {
+    lastHist = ancestorList.ids().size();
     edm::LogError("SimTrackManager") << " SimTrackManager::fillMotherList track index corrupted";
   }
 
-  for (unsigned int n = lastHist; n < ancestorList.size(); n++) { 
+  for (unsigned int n = lastHist; n < ancestorList.ids().size(); n++) { 
     
-    int theMotherId = idSavedTrack((ancestorList[n]).first);
-    ancestorList[n].second = theMotherId;
+    unsigned int theTrackId = ancestorList.ids()[n];
+    int theMotherId = idSavedTrack(theTrackId);
+    ancestorList.set(theTrackId,theMotherId);
 #ifdef DebugLog
-    LogDebug("SimTrackManager")  << "Track ID = " << (ancestorList[n]).first << " Mother ID = " << (ancestorList[n]).second;
+    LogDebug("SimTrackManager")  << "Track ID = " << theTrackId << " Mother ID = " << theMotherId;
 #endif    
   }
 
-  lastHist = ancestorList.size();
+  lastHist = ancestorList.ids().size();
 
   idsave.clear();
 
@@ -251,21 +491,24 @@ void SimTrackManager::cleanTracksWithHistory(){
 
   using namespace std;
 
-  if ((*m_trksForThisEvent).size() == 0 && idsave.size() == 0) return;
+  if ((*m_trksForThisEvent).size() == 0 && lastTrack == 0 && idsave.empty()) return;
 
 #ifdef DebugLog
-  LogDebug("SimTrackManager") << "SimTrackManager::cleanTracksWithHistory has " << idsave.size() 
+  LogDebug("SimTrackManager") << "SimTrackManager::cleanTracksWithHistory has " << idsave.ids().size() 
                               << " mother-daughter relationships stored with lastTrack = " << lastTrack;
 #endif
 
-  if ( lastTrack > 0 && lastTrack >= (*m_trksForThisEvent).size() ) {
-    lastTrack = 0;
+  unsigned int firstNew = lastTrack - m_nSpilled - m_packedTracks.size();
+  if ( lastTrack > 0 && firstNew >= (*m_trksForThisEvent).size() ) {
     edm::LogError("SimTrackManager") << " SimTrackManager::cleanTracksWithHistory track index corrupted";
+    // no new track: cleaning the whole history again only saves tracks
+    // which are saved already, but it leaves the history fully ordered
+    sortByTrackID(0);
+    std::stable_sort(m_cleanedTracks.begin(),m_cleanedTracks.end(),cleanedTrackLess);
+    firstNew = (*m_trksForThisEvent).size();
   }
   
-  stable_sort(m_trksForThisEvent->begin()+lastTrack,m_trksForThisEvent->end(),trkIDLess());
-  
-  stable_sort(idsave.begin(),idsave.end());
+  sortByTrackID(firstNew);
   
 #ifdef DebugLog
   LogDebug("SimTrackManager")  << " SimTrackManager::cleanTracksWithHistory knows " << m_trksForThisEvent->size()
@@ -277,27 +520,30 @@ void SimTrackManager::cleanTracksWithHistory(){
                                   << " status " << (*m_trksForThisEvent)[it]->saved();
 #endif  
 
-  for (unsigned int it = lastTrack; it < m_trksForThisEvent->size(); it++)
+  // the branches are followed on the compact records of the new tracks
+  // only; the tracks themselves are touched once more, to be kept or
+  // given back
+  for (unsigned int ir = 0; ir < m_trackRecords.size(); ir++)
     {
-      TrackWithHistory * t = (*m_trksForThisEvent)[it];
-      if (t->saved()) saveTrackAndItsBranch(t);
+      if (m_trackRecords[ir].saved) saveTrackAndItsBranch(ir);
     }
-  unsigned int num = lastTrack;
-  for (unsigned int it = lastTrack; it < m_trksForThisEvent->size(); it++)
+  unsigned int num = firstNew;
+  for (unsigned int ir = 0; ir < m_trackRecords.size(); ir++)
     {
-      TrackWithHistory * t = (*m_trksForThisEvent)[it];
-      int g4ID = t->trackID();
-      if (t->saved() == true)
+      const TrackRecord & record = m_trackRecords[ir];
+      TrackWithHistory * t = (*m_trksForThisEvent)[firstNew+ir];
+      int g4ID = record.trackID;
+      if (record.saved)
         {
-          if (it>num) (*m_trksForThisEvent)[num] = t;
+          t->save();
+          (*m_trksForThisEvent)[num] = t;
           num++;
-	  for (unsigned int itr=0; itr<idsave.size(); itr++) { 
-	    if ((idsave[itr]).first == g4ID) { 
-	      (idsave[itr]).second = g4ID; break; } 
-	  }
+          m_cleanedTracks.push_back(std::pair<unsigned int,int>(g4ID,record.parentID));
+          if (idsave[g4ID] >= 0) idsave.set(g4ID,g4ID);
         }
       else 
         {	
+          m_inHistory.set(g4ID,0);
           delete t;
         }
     }
@@ -316,8 +562,65 @@ void SimTrackManager::cleanTracksWithHistory(){
 
   fillMotherList();
 
-  lastTrack = (*m_trksForThisEvent).size();
+  lastTrack = m_nSpilled + m_packedTracks.size() + (*m_trksForThisEvent).size();
+
+  // all the tracks in memory are cleaned now; the ceiling counts them as
+  // they are, packed or not
+  bool spill = (m_maxHistoryMemory > 0 && 
+                (*m_trksForThisEvent).size()*sizeof(TrackWithHistory) 
+                + m_packedTracks.size()*sizeof(PackedTrack) > m_maxHistoryMemory);
+  if (m_streamPrimaries || spill) packTracks();
+  if (spill) spillTracks();
+
+}
+
+void SimTrackManager::spillTracks(){
+
+  // the packed tracks are written after the ones spilled already
+  static_assert(std::is_pod<PackedTrack>::value, "PackedTrack is written to file as it is");
+  if (m_spillFile == 0) {
+    m_spillFile = std::tmpfile();
+    if (m_spillFile == 0) {
+      edm::LogWarning("SimTrackManager") << " SimTrackManager: cannot open a file to spill the track history,"
+                                         << " it stays in memory";
+      m_maxHistoryMemory = 0;
+      return;
+    }
+  }
+
+  unsigned int nTracks = m_packedTracks.size();
+  bool ok = (std::fseek(m_spillFile,long(m_nSpilled*sizeof(PackedTrack)),SEEK_SET) == 0);
+  if (ok) ok = (std::fwrite(&m_packedTracks[0],sizeof(PackedTrack),nTracks,m_spillFile) == nTracks);
+  if (ok) ok = (std::fflush(m_spillFile) == 0);
+  if (!ok) {
+    // what was written beyond the m_nSpilled first records is ignored
+    edm::LogWarning("SimTrackManager") << " SimTrackManager: cannot spill the track history,"
+                                       << " it stays in memory";
+    m_maxHistoryMemory = 0;
+    return;
+  }
+
+  m_packedTracks.clear();
+  m_nSpilled += nTracks;
+
+#ifdef DebugLog
+  LogDebug("SimTrackManager") << " SimTrackManager::spillTracks " << nTracks << " tracks, " 
+                              << m_nSpilled << " on file";
+#endif
+}
 
+void SimTrackManager::closeSpillFile(){
+  if (m_spillFile != 0) std::fclose(m_spillFile);
+  m_spillFile = 0;
+  m_nSpilled = 0;
+}
+
+void SimTrackManager::fillLHCTransportLinkMap( const edm::LHCTransportLinkContainer & links, 
+                                               LHCTransportLinkMap & linkMap ) {
+  linkMap.clear();
+  for ( unsigned int itrlink = 0; itrlink < links.size(); itrlink++ ) {
+    linkMap[links[itrlink].afterHector()] = links[itrlink].beforeHector();
+  }
 }
 
 void SimTrackManager::resetGenID() {
@@ -330,15 +633,9 @@ void SimTrackManager::resetGenID() {
       int genParticleID_ = trkH->genParticleID();
       if ( genParticleID_ == -1 ) { continue; }
       else {
-        for ( unsigned int itrlink = 0; itrlink < (*theLHCTlink).size(); itrlink++ ) {
-          if ( (*theLHCTlink)[itrlink].afterHector() == genParticleID_ ) {
-            trkH->setGenParticleID( (*theLHCTlink)[itrlink].beforeHector() );
-            continue;
-          }
-        }
+        LHCTransportLinkMap::const_iterator itrlink = theLHCTlink->find(genParticleID_);
+        if ( itrlink != theLHCTlink->end() ) trkH->setGenParticleID( itrlink->second );
       }
     }
 
-  theLHCTlink = 0;
-
 }
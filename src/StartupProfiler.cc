@@ -0,0 +1,103 @@
+#include "SimG4Core/Application/interface/StartupProfiler.h"
+
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+StartupProfiler::StartupProfiler() : m_running(false) {}
+
+StartupProfiler::~StartupProfiler() {}
+
+void StartupProfiler::start(const std::string & phase)
+{
+    if (m_running) stop();
+    m_current = phase;
+    m_running = true;
+    m_startOfPhase = now();
+}
+
+void StartupProfiler::stop()
+{
+    if (!m_running) return;
+    Sample end = now();
+    Phase p;
+    p.name     = m_current;
+    p.wallTime = end.wallTime - m_startOfPhase.wallTime;
+    p.cpuTime  = end.cpuTime  - m_startOfPhase.cpuTime;
+    p.rssDelta = end.rss      - m_startOfPhase.rss;
+    m_phases.push_back(p);
+    m_running = false;
+}
+
+void StartupProfiler::report(const std::string & fileName) const
+{
+    double wall = 0, cpu = 0, rss = 0;
+    std::ostringstream summary;
+    summary << " RunManager: initG4 timing (wall s / cpu s / RSS MB)";
+    for (unsigned int i=0; i<m_phases.size(); i++)
+    {
+        const Phase & p = m_phases[i];
+        summary << "\n  " << std::setw(20) << std::left << p.name << std::right
+                << std::fixed << std::setprecision(3)
+                << std::setw(10) << p.wallTime
+                << std::setw(10) << p.cpuTime
+                << std::setprecision(1) << std::setw(10) << p.rssDelta;
+        wall += p.wallTime; cpu += p.cpuTime; rss += p.rssDelta;
+    }
+    summary << "\n  " << std::setw(20) << std::left << "Total" << std::right
+            << std::fixed << std::setprecision(3)
+            << std::setw(10) << wall << std::setw(10) << cpu
+            << std::setprecision(1) << std::setw(10) << rss;
+    edm::LogInfo("SimG4CoreApplication") << summary.str();
+
+    if (!fileName.empty()) writeJSON(fileName);
+}
+
+void StartupProfiler::writeJSON(const std::string & fileName) const
+{
+    std::ofstream out(fileName.c_str());
+    if (!out)
+    {
+        edm::LogWarning("SimG4CoreApplication") << " RunManager: cannot write initG4 report to "
+                                                << fileName;
+        return;
+    }
+    out << std::setprecision(6) << "{\n  \"phases\": [";
+    for (unsigned int i=0; i<m_phases.size(); i++)
+    {
+        const Phase & p = m_phases[i];
+        out << (i==0 ? "\n" : ",\n")
+            << "    {\"name\": \"" << p.name << "\", \"wall_s\": " << p.wallTime
+            << ", \"cpu_s\": " << p.cpuTime << ", \"rss_delta_mb\": " << p.rssDelta << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+StartupProfiler::Sample StartupProfiler::now()
+{
+    Sample s;
+
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    s.wallTime = tv.tv_sec + 1.e-6*tv.tv_usec;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    s.cpuTime = ru.ru_utime.tv_sec + 1.e-6*ru.ru_utime.tv_usec
+              + ru.ru_stime.tv_sec + 1.e-6*ru.ru_stime.tv_usec;
+
+    // second field of statm is the resident set size in pages
+    s.rss = 0;
+    long pages, rssPages;
+    std::ifstream statm("/proc/self/statm");
+    if (statm >> pages >> rssPages)
+        s.rss = rssPages*(sysconf(_SC_PAGESIZE)/1048576.);
+
+    return s;
+}
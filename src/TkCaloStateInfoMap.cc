@@ -0,0 +1,80 @@
+#include "SimG4Core/Application/interface/TkCaloStateInfoMap.h"
+
+namespace {
+  const unsigned int initialBits = 10;
+}
+
+TkCaloStateInfoMap::TkCaloStateInfoMap()
+{
+    release();
+}
+
+TkCaloStateInfoMap::~TkCaloStateInfoMap() {}
+
+void TkCaloStateInfoMap::insert(uint32_t id, const TkCaloStateInfo & info)
+{
+    // keep the table at most half full
+    if (2*(m_size+1) > m_slots.size()) grow();
+
+    unsigned int mask = m_slots.size()-1;
+    for (unsigned int i = slotOf(id); ; i = (i+1) & mask) {
+        Slot & s = m_slots[i];
+        if (s.generation != m_generation) {
+            s.id = id;
+            s.generation = m_generation;
+            s.info = info;
+            m_size++;
+            return;
+        }
+        if (s.id == id) return;
+    }
+}
+
+const TkCaloStateInfoMap::TkCaloStateInfo * TkCaloStateInfoMap::find(uint32_t id) const
+{
+    unsigned int mask = m_slots.size()-1;
+    for (unsigned int i = slotOf(id); ; i = (i+1) & mask) {
+        const Slot & s = m_slots[i];
+        if (s.generation != m_generation) return 0;
+        if (s.id == id) return &(s.info);
+    }
+}
+
+void TkCaloStateInfoMap::clear()
+{
+    m_size = 0;
+    if (++m_generation == 0) {
+        // the generation number wrapped around: forget the old ones for real
+        for (unsigned int i = 0; i < m_slots.size(); i++) m_slots[i].generation = 0;
+        m_generation = 1;
+    }
+}
+
+void TkCaloStateInfoMap::release()
+{
+    Slot empty;
+    empty.id = 0;
+    empty.generation = 0;
+    std::vector<Slot>(1U << initialBits, empty).swap(m_slots);
+    m_shift = 32-initialBits;
+    m_size = 0;
+    m_generation = 1;
+}
+
+void TkCaloStateInfoMap::grow()
+{
+    std::vector<Slot> old;
+    old.swap(m_slots);
+    unsigned int oldGeneration = m_generation;
+
+    Slot empty;
+    empty.id = 0;
+    empty.generation = 0;
+    m_slots.assign(2*old.size(), empty);
+    m_shift--;
+    m_size = 0;
+    m_generation = 1;
+
+    for (unsigned int i = 0; i < old.size(); i++)
+        if (old[i].generation == oldGeneration) insert(old[i].id, old[i].info);
+}
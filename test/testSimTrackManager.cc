@@ -0,0 +1,235 @@
+// Replays random track histories through SimTrackManager and checks the
+// stored G4SimTracks and G4SimVertices against linear scans over the
+// history, i.e. the parent lookups reallyStoreTracks did before it
+// indexed the tracks by ID, and their GenParticle ids against the linear
+// scan over the LHCTransport links resetGenID did before the link map,
+// with afterHector ids appearing more than once. The same events are
+// replayed with StreamFinishedPrimaries. Then times storeTracks for
+// events of growing size: the time per stored track should stay flat.
+//
+// usage: testSimTrackManager [nEvents] [maxTracks]
+
+#include "SimG4Core/Application/interface/SimTrackManager.h"
+#include "SimG4Core/Application/interface/G4SimEvent.h"
+#include "SimG4Core/Application/interface/G4SimTrack.h"
+#include "SimG4Core/Application/interface/G4SimVertex.h"
+#include "SimG4Core/Notification/interface/NewTrackAction.h"
+#include "SimG4Core/Notification/interface/TrackWithHistory.h"
+#include "SimDataFormats/Forward/interface/LHCTransportLinkContainer.h"
+
+#include "G4Track.hh"
+#include "G4DynamicParticle.hh"
+#include "G4Electron.hh"
+#include "G4ThreeVector.hh"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+  std::mt19937 engine(12345);
+
+  double uniform() { return std::uniform_real_distribution<double>(0.,1.)(engine); }
+  unsigned int uniform(unsigned int n) { return std::uniform_int_distribution<unsigned int>(0,n-1)(engine); }
+
+  struct Track {
+    unsigned int id;
+    int parent;
+    int genParticle;
+    bool save;
+    G4ThreeVector momentum;
+    G4ThreeVector vertex;
+    double time;
+    unsigned int depth;
+  };
+
+  // the tracks in the order Geant4 would follow them: the primaries, each
+  // with its secondaries depth first, up to about nTracks tracks and 10
+  // generations. Secondaries often start at the same point, or within the
+  // vertex tolerance, to have vertices merged
+  std::vector<Track> makeEvent(unsigned int nPrimaries, unsigned int nTracks, double saveFraction) {
+    std::vector<Track> pending, event;
+    for (unsigned int i = nPrimaries; i >= 1; i--) {
+      Track t;
+      t.id = i;
+      t.parent = 0;
+      t.genParticle = uniform(4) ? uniform(2*nPrimaries) : -1;
+      t.depth = 0;
+      t.vertex = G4ThreeVector(0.,0.,uniform(2)*0.0004);
+      pending.push_back(t);
+    }
+    unsigned int nextID = nPrimaries+1;
+    while (!pending.empty()) {
+      Track t = pending.back();
+      pending.pop_back();
+      // the primaries are always stored, as NewTrackAction asks for them
+      t.save = (t.parent == 0 || uniform() < saveFraction);
+      t.momentum = G4ThreeVector(uniform()*10.,uniform()*10.,uniform()*10.);
+      t.time = uniform();
+      event.push_back(t);
+      G4ThreeVector end(uniform(),uniform(),uniform());
+      unsigned int nSecondaries = (nextID <= nTracks && t.depth < 10) ? uniform(4) : 0;
+      for (unsigned int k = 0; k < nSecondaries; k++) {
+        Track s;
+        s.id = nextID++;
+        s.parent = t.id;
+        s.genParticle = -1;
+        s.depth = t.depth+1;
+        switch (uniform(3)) {
+        case 0:  s.vertex = end; break;
+        case 1:  s.vertex = end+G4ThreeVector(0.0004,0.,0.); break;
+        default: s.vertex = G4ThreeVector(uniform(),uniform(),uniform());
+        }
+        pending.push_back(s);
+      }
+    }
+    return event;
+  }
+
+  TrackWithHistory * makeTrackWithHistory(const Track & t) {
+    G4Track * g4 = new G4Track(new G4DynamicParticle(G4Electron::Definition(),t.momentum),t.time,t.vertex);
+    g4->SetTrackID(t.id);
+    g4->SetParentID(t.parent);
+    NewTrackAction().primary(g4);
+    TrackWithHistory * trk = new TrackWithHistory(g4);
+    delete g4;
+    trk->setGenParticleID(t.genParticle);
+    if (t.save) trk->save();
+    return trk;
+  }
+
+  // links with afterHector ids from a small range, so that many repeat
+  edm::LHCTransportLinkContainer makeLinks(unsigned int nPrimaries) {
+    edm::LHCTransportLinkContainer links;
+    unsigned int nLinks = uniform(2*nPrimaries);
+    for (unsigned int i = 0; i < nLinks; i++) {
+      int beforeHector = uniform(1000);
+      int afterHector = uniform(nPrimaries);
+      links.push_back(LHCTransportLink(beforeHector,afterHector));
+    }
+    return links;
+  }
+
+  // the loop of resetGenID before the link map: every link is compared
+  // to the original id, so the last matching link wins
+  int linearScan(int genParticleID, const edm::LHCTransportLinkContainer & links) {
+    int result = genParticleID;
+    if (genParticleID == -1) return result;
+    for (unsigned int itrlink = 0; itrlink < links.size(); itrlink++) {
+      if (links[itrlink].afterHector() == genParticleID) result = links[itrlink].beforeHector();
+    }
+    return result;
+  }
+
+  // what RunManager, EventAction and TrackingAction do with the history
+  // of an event, up to storeTracks
+  void fillHistory(SimTrackManager & manager, const std::vector<Track> & event,
+                   const SimTrackManager::LHCTransportLinkMap * linkMap) {
+    manager.reset();
+    manager.setLHCTransportLink(linkMap);
+    for (unsigned int i = 0; i < event.size(); i++) {
+      if (event[i].parent == 0) manager.cleanTracksWithHistory();
+      manager.addTrack(makeTrackWithHistory(event[i]),true,false);
+    }
+  }
+
+  void finish(SimTrackManager & manager) {
+    manager.deleteTracks();
+    manager.cleanTkCaloStateInfoMap();
+  }
+
+  const Track * find(const std::vector<Track> & event, int id) {
+    for (unsigned int i = 0; i < event.size(); i++)
+      if (int(event[i].id) == id) return &event[i];
+    return 0;
+  }
+
+  bool same(const math::XYZVectorD & a, const G4ThreeVector & b) {
+    return std::abs(a.x()-b.x()) < 1e-9 && std::abs(a.y()-b.y()) < 1e-9 && std::abs(a.z()-b.z()) < 1e-9;
+  }
+
+  // number of differences between simEvent and the history
+  unsigned int check(const std::vector<Track> & event, const edm::LHCTransportLinkContainer & links,
+                     const G4SimEvent & simEvent) {
+    // a track is stored if it is saved or has a saved descendant
+    std::vector<Track> stored;
+    std::vector<bool> isStored(event.size()+1,false);
+    for (unsigned int i = 0; i < event.size(); i++) {
+      if (!event[i].save) continue;
+      for (const Track * t = &event[i]; t != 0 && !isStored[t->id]; t = find(event,t->parent)) isStored[t->id] = true;
+    }
+    for (unsigned int id = 1; id < isStored.size(); id++)
+      if (isStored[id]) stored.push_back(*find(event,id));
+
+    unsigned int nErrors = 0;
+    if (simEvent.nTracks() != stored.size()) {
+      std::cout << " stored " << simEvent.nTracks() << " tracks instead of " << stored.size() << std::endl;
+      return 1;
+    }
+    for (unsigned int i = 0; i < stored.size(); i++) {
+      const Track & t = stored[i];
+      const G4SimTrack & trk = simEvent.g4track(i+1);
+      const Track * parent = find(stored,t.parent);
+      bool ok = (trk.id() == int(t.id) && same(trk.momentum(),t.momentum));
+      ok = ok && (parent != 0 ? same(trk.parentMomentum(),parent->momentum) : same(trk.parentMomentum(),G4ThreeVector()));
+      ok = ok && trk.igenpart() == linearScan(t.genParticle,links);
+      ok = ok && trk.ivert() >= 0 && (unsigned int)trk.ivert() < simEvent.nVertices();
+      if (ok) {
+        const G4SimVertex & vertex = simEvent.g4vertex(trk.ivert()+1);
+        const math::XYZVectorD & pos = vertex.vertexPosition();
+        G4ThreeVector distance = G4ThreeVector(pos.x(),pos.y(),pos.z())-t.vertex;
+        ok = (vertex.parentIndex() == (parent != 0 ? t.parent : -1) && distance.mag() < 0.001);
+      }
+      if (!ok) {
+        std::cout << " track " << t.id << " of parent " << t.parent << " differs" << std::endl;
+        nErrors++;
+      }
+    }
+    return nErrors;
+  }
+}
+
+int main(int argc, char ** argv) {
+  unsigned int nEvents = (argc > 1) ? std::atoi(argv[1]) : 100;
+  unsigned int maxTracks = (argc > 2) ? std::atoi(argv[2]) : 100000;
+
+  SimTrackManager manager;
+  SimTrackManager streaming;
+  streaming.setStreamPrimaries(true);
+  unsigned int nErrors = 0;
+  for (unsigned int ev = 0; ev < nEvents; ev++) {
+    unsigned int nPrimaries = 1+uniform(20);
+    std::vector<Track> event = makeEvent(nPrimaries,uniform(2000),0.2);
+    edm::LHCTransportLinkContainer links = makeLinks(nPrimaries);
+    SimTrackManager::LHCTransportLinkMap linkMap;
+    SimTrackManager::fillLHCTransportLinkMap(links,linkMap);
+    SimTrackManager * managers[2] = { &manager, &streaming };
+    for (unsigned int m = 0; m < 2; m++) {
+      G4SimEvent simEvent;
+      fillHistory(*managers[m],event,&linkMap);
+      managers[m]->storeTracks(&simEvent);
+      nErrors += check(event,links,simEvent);
+      finish(*managers[m]);
+    }
+  }
+  std::cout << "testSimTrackManager: " << nEvents << " events, " << nErrors << " differences" << std::endl;
+
+  // all tracks saved: storeTracks alone, per stored track
+  for (unsigned int nTracks = 1000; nTracks <= maxTracks; nTracks *= 10) {
+    std::vector<Track> event = makeEvent(nTracks/50,nTracks,1.);
+    G4SimEvent simEvent;
+    fillHistory(manager,event,0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    manager.storeTracks(&simEvent);
+    std::chrono::duration<double> time = std::chrono::steady_clock::now()-start;
+    std::cout << "testSimTrackManager: storeTracks of " << simEvent.nTracks() << " tracks "
+              << time.count() << " s, " << 1e9*time.count()/simEvent.nTracks() << " ns per track" << std::endl;
+    finish(manager);
+  }
+
+  return (nErrors == 0) ? 0 : 1;
+}